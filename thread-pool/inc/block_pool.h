@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef> //size_t, max_align_t
+#include <new>     //operator new, bad_alloc
+
+// block_pool recycles small memory blocks, so that the hot paths of the
+//  thread_pool - wrapping a task, creating the shared state of its future -
+//  do not go through the global allocator once the program is warm.
+//  Blocks are sorted in size classes of 64, 128, 256 and 512 bytes; anything
+//  bigger is forwarded to ::operator new.
+//  Each thread keeps its own free lists, so allocating and freeing never
+//  take a lock. A thread that frees more than it allocates - typically a
+//  worker destroying tasks submitted by another thread - hands its surplus
+//  over to a shared depot in batches, where allocating threads pick them up.
+class block_pool {
+public:
+  static void *allocate(size_t size);
+  static void  deallocate(void *block, size_t size) noexcept;
+};
+
+// pool_allocator exposes block_pool through the Allocator requirements, so
+//  that standard facilities - std::promise and std::allocate_shared, for
+//  instance - can get their storage from it.
+template <typename T>
+class pool_allocator {
+public:
+  using value_type = T;
+
+  pool_allocator() = default;
+  template <typename U>
+  pool_allocator(const pool_allocator<U> &) {}
+
+  T *allocate(size_t n) {
+    static_assert(alignof(T) <= alignof(std::max_align_t),
+                  "over-aligned types are not supported by block_pool");
+    return static_cast<T *>(block_pool::allocate(n * sizeof(T)));
+  }
+
+  void deallocate(T *ptr, size_t n) noexcept {
+    block_pool::deallocate(ptr, n * sizeof(T));
+  }
+
+  template <typename U>
+  bool operator==(const pool_allocator<U> &) const { return true; }
+  template <typename U>
+  bool operator!=(const pool_allocator<U> &) const { return false; }
+};
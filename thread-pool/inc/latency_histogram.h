@@ -0,0 +1,95 @@
+#pragma once
+
+#include <array>   //array
+#include <bit>     //bit_width
+#include <chrono>  //nanoseconds
+#include <cstddef> //size_t
+#include <cstdint> //uint64_t
+
+// latency_histogram counts durations in log-linear buckets, the way HDR
+//  histograms do: every power of two is split into 8 sub-buckets, so that
+//  any recorded value is known within 12.5%, from a nanosecond up to about
+//  18 minutes - longer durations land in the last bucket.
+//  It is a plain value type: thread_pool fills one per worker from its
+//  counters when a snapshot is taken, and they may then be added up.
+class latency_histogram {
+  static constexpr size_t _sub_bits     = 3;
+  static constexpr size_t _sub_buckets  = size_t(1) << _sub_bits;
+  static constexpr size_t _max_exponent = 40;
+
+public:
+  static constexpr size_t bucket_count =
+      size_t(_max_exponent - _sub_bits + 1) << _sub_bits;
+
+  static size_t bucket_of(std::chrono::nanoseconds duration) {
+    const uint64_t value =
+        duration.count() > 0 ? uint64_t(duration.count()) : 0;
+    if (value < _sub_buckets)
+      return size_t(value);
+
+    const size_t exponent = size_t(std::bit_width(value)) - 1;
+    if (exponent >= _max_exponent)
+      return bucket_count - 1;
+
+    const size_t sub =
+        size_t(value >> (exponent - _sub_bits)) & (_sub_buckets - 1);
+    return ((exponent - _sub_bits + 1) << _sub_bits) + sub;
+  }
+
+  // the smallest and the largest duration that end up in bucket.
+  static std::chrono::nanoseconds lower_bound(size_t bucket) {
+    if (bucket < _sub_buckets)
+      return std::chrono::nanoseconds(bucket);
+
+    const size_t exponent = (bucket >> _sub_bits) + _sub_bits - 1;
+    const size_t sub      = bucket & (_sub_buckets - 1);
+    return std::chrono::nanoseconds(
+        int64_t((_sub_buckets + sub) << (exponent - _sub_bits)));
+  }
+  static std::chrono::nanoseconds upper_bound(size_t bucket) {
+    if (bucket + 1 == bucket_count)
+      return std::chrono::nanoseconds::max();
+    return lower_bound(bucket + 1) - std::chrono::nanoseconds(1);
+  }
+
+  void record(std::chrono::nanoseconds duration) {
+    add(bucket_of(duration), 1);
+  }
+
+  void add(size_t bucket, uint64_t count) {
+    _counts[bucket] += count;
+    _total += count;
+  }
+
+  latency_histogram &operator+=(const latency_histogram &other) {
+    for (size_t i = 0; i < bucket_count; ++i)
+      _counts[i] += other._counts[i];
+    _total += other._total;
+    return *this;
+  }
+
+  uint64_t count() const { return _total; }
+  uint64_t count(size_t bucket) const { return _counts[bucket]; }
+
+  // the duration that fraction - between 0 and 1 - of the recorded ones do
+  //  not exceed, rounded up to the end of its bucket. Zero when empty.
+  std::chrono::nanoseconds percentile(double fraction) const {
+    uint64_t rank = uint64_t(fraction * double(_total) + 0.5);
+    if (rank == 0)
+      rank = 1;
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < bucket_count; ++i) {
+      seen += _counts[i];
+      if (seen >= rank)
+        return upper_bound(i);
+    }
+    return std::chrono::nanoseconds(0);
+  }
+
+  std::chrono::nanoseconds max() const { return percentile(1.0); }
+
+private:
+  std::array<uint64_t, bucket_count> _counts{};
+  uint64_t                           _total{0};
+};
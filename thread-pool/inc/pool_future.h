@@ -0,0 +1,338 @@
+#pragma once
+
+#include <atomic>             //atomic
+#include <chrono>             //microseconds
+#include <condition_variable> //condition_variable
+#include <exception>          //exception_ptr, rethrow_exception
+#include <future>             //future_error, future_errc
+#include <memory>             //shared_ptr, allocate_shared
+#include <mutex>              //mutex, unique_lock
+#include <optional>           //optional
+#include <stdexcept>          //invalid_argument
+#include <type_traits>        //add_lvalue_reference_t, conditional_t, decay_t
+#include <utility>            //move, forward
+#include <variant>            //monostate
+#include <vector>             //vector
+
+#include "threadpool.h"
+
+// pool_future is the future returned by thread_pool::spawn. Unlike a
+//  std::future, it knows the pool its value comes from, which lets it
+//  schedule work on it once it is ready:
+//    pool.spawn(load).then(parse).then(store);
+//  runs parse as a new task as soon as load returns, without any thread
+//  blocking in between.
+//  A pool_future is a shared handle, like std::shared_future: copies refer
+//  to the same result, which get() may read any number of times, and each
+//  of them may be given continuations.
+//  As with std::shared_future, using an invalid future - is_ready, wait, get
+//  or then - throws a std::future_error with future_errc::no_state.
+template <typename T>
+class pool_future {
+public:
+  static_assert(!std::is_reference_v<T>,
+                "pool_future does not support references");
+
+  pool_future() = default;
+
+  bool valid() const { return _state != nullptr; }
+  bool is_ready() const;
+
+  // blocks until the result is there. On a worker of the pool, runs pending
+  //  tasks in the meantime - see thread_pool::wait.
+  void wait() const;
+
+  // waits, then returns the result - or rethrows the exception the task
+  //  ended with.
+  std::add_lvalue_reference_t<const T> get() const;
+
+  // schedules function on the pool once this future is ready, and returns
+  //  the future of its result. function is given the result - nothing when
+  //  T is void. If this future holds an exception instead, function is not
+  //  called and the returned future holds the same exception.
+  template <typename F>
+  auto then(F &&function);
+
+private:
+  template <typename> friend class pool_future;
+  friend class thread_pool;
+
+  using _value_type = std::conditional_t<std::is_void_v<T>, std::monostate, T>;
+
+  struct _shared_state {
+    explicit _shared_state(thread_pool *owner) : pool(owner) {}
+
+    thread_pool                        *pool;
+    std::mutex                          mutex;
+    std::condition_variable             ready_cv;
+    bool                                ready{false};
+    std::optional<_value_type>          value;
+    std::exception_ptr                  error;
+
+    // continuations are enqueued on the pool, callbacks - the bookkeeping
+    //  of when_all and when_any - run inline, on the completing thread.
+    std::vector<thread_pool::_task_ptr> continuations;
+    std::vector<thread_pool::_task_ptr> callbacks;
+  };
+  using _state_ptr = std::shared_ptr<_shared_state>;
+
+  explicit pool_future(_state_ptr state) : _state(std::move(state)) {}
+
+  void _check_state() const {
+    if (!_state)
+      throw std::future_error(std::future_errc::no_state);
+  }
+
+  static _state_ptr _make_state(thread_pool *pool);
+
+  // runs function and completes state with its outcome.
+  template <typename F>
+  static void _fulfil(_shared_state &state, F &&function);
+
+  // the callable of a task fulfilling state - which the pool completes with
+  //  task_cancelled if it drops the task.
+  template <typename F>
+  struct _fulfilling_call {
+    _state_ptr state;
+    F          function;
+
+    void operator()() { _fulfil(*state, function); }
+    void cancel() {
+      _complete(*state, std::nullopt,
+                std::make_exception_ptr(thread_pool::task_cancelled()));
+    }
+  };
+
+  template <typename F>
+  static thread_pool::_task_ptr _make_task(_state_ptr state, F &&function);
+
+  static void _complete(_shared_state &state,
+                        std::optional<_value_type> value,
+                        std::exception_ptr error);
+
+  // runs callback on the completing thread once ready - or right away if
+  //  the future is already ready.
+  template <typename F>
+  void _on_ready(F &&callback) const;
+
+  _state_ptr _state;
+};
+
+template <typename T>
+bool pool_future<T>::is_ready() const {
+  _check_state();
+  std::lock_guard<std::mutex> state_lock(_state->mutex);
+  return _state->ready;
+}
+
+template <typename T>
+void pool_future<T>::wait() const {
+  _check_state();
+  std::unique_lock<std::mutex> state_lock(_state->mutex);
+  if (!_state->pool->_on_worker()) {
+    _state->ready_cv.wait(state_lock, [&]() -> bool { return _state->ready; });
+    return;
+  }
+
+  while (!_state->ready) {
+    state_lock.unlock();
+    bool helped = _state->pool->_run_pending_task();
+    state_lock.lock();
+
+    if (!helped && !_state->ready)
+      _state->ready_cv.wait_for(state_lock, std::chrono::microseconds(100));
+  }
+}
+
+template <typename T>
+std::add_lvalue_reference_t<const T>
+pool_future<T>::get() const {
+  wait();
+
+  // once ready, a state is never written again: it can be read unlocked.
+  if (_state->error)
+    std::rethrow_exception(_state->error);
+
+  if constexpr (!std::is_void_v<T>)
+    return *_state->value;
+}
+
+template <typename T>
+template <typename F>
+auto pool_future<T>::then(F &&function) {
+  _check_state();
+  using argument_type = std::add_lvalue_reference_t<const T>;
+  using result_type   = typename std::conditional_t<
+      std::is_void_v<T>, std::invoke_result<F &>,
+      std::invoke_result<F &, argument_type>>::type;
+
+  auto next = pool_future<result_type>::_make_state(_state->pool);
+
+  thread_pool::_task_ptr task = pool_future<result_type>::_make_task(
+      next, [source = _state, _f = std::forward<F>(function)]() mutable
+                -> result_type {
+        if (source->error)
+          std::rethrow_exception(source->error);
+
+        if constexpr (std::is_void_v<T>)
+          return _f();
+        else
+          return _f(*source->value);
+      });
+
+  {
+    std::lock_guard<std::mutex> state_lock(_state->mutex);
+    if (!_state->ready) {
+      _state->continuations.push_back(std::move(task));
+      return pool_future<result_type>(std::move(next));
+    }
+  }
+
+  _state->pool->_enqueue(std::move(task));
+  return pool_future<result_type>(std::move(next));
+}
+
+template <typename T>
+typename pool_future<T>::_state_ptr
+pool_future<T>::_make_state(thread_pool *pool) {
+  return std::allocate_shared<_shared_state>(pool_allocator<_shared_state>(),
+                                             pool);
+}
+
+template <typename T>
+template <typename F>
+thread_pool::_task_ptr pool_future<T>::_make_task(_state_ptr state,
+                                                  F        &&function) {
+  return thread_pool::_task_ptr(new thread_pool::_task_container(
+      _fulfilling_call<std::decay_t<F>>{std::move(state),
+                                        std::forward<F>(function)}));
+}
+
+template <typename T>
+template <typename F>
+void pool_future<T>::_fulfil(_shared_state &state, F &&function) {
+  std::optional<_value_type> value;
+  std::exception_ptr         error;
+
+  try {
+    if constexpr (std::is_void_v<T>) {
+      function();
+      value.emplace();
+    } else {
+      value.emplace(function());
+    }
+  } catch (...) {
+    error = std::current_exception();
+  }
+
+  _complete(state, std::move(value), std::move(error));
+}
+
+template <typename T>
+void pool_future<T>::_complete(_shared_state &state,
+                               std::optional<_value_type> value,
+                               std::exception_ptr error) {
+  std::vector<thread_pool::_task_ptr> continuations;
+  std::vector<thread_pool::_task_ptr> callbacks;
+  {
+    std::lock_guard<std::mutex> state_lock(state.mutex);
+    state.value = std::move(value);
+    state.error = std::move(error);
+    state.ready = true;
+    continuations.swap(state.continuations);
+    callbacks.swap(state.callbacks);
+  }
+  state.ready_cv.notify_all();
+
+  for (auto &callback : callbacks)
+    (*callback)();
+
+  state.pool->_enqueue_all(continuations.data(), continuations.size());
+}
+
+template <typename T>
+template <typename F>
+void pool_future<T>::_on_ready(F &&callback) const {
+  thread_pool::_task_ptr task(
+      new thread_pool::_task_container(std::forward<F>(callback)));
+  {
+    std::lock_guard<std::mutex> state_lock(_state->mutex);
+    if (!_state->ready) {
+      _state->callbacks.push_back(std::move(task));
+      return;
+    }
+  }
+  (*task)();
+}
+
+template <typename F, typename... Args,
+          std::enable_if_t<is_pool_invocable_v<F, Args...>, int>>
+auto thread_pool::spawn(F &&function, Args &&...args)
+{
+  using result_type = _invoke_result_t<F, Args...>;
+
+  auto state = pool_future<result_type>::_make_state(this);
+
+  _enqueue(pool_future<result_type>::_make_task(
+      state, _bind(std::forward<F>(function), std::forward<Args>(args)...)));
+
+  return pool_future<result_type>(std::move(state));
+}
+
+template <typename T>
+pool_future<std::vector<pool_future<T>>>
+thread_pool::when_all(std::vector<pool_future<T>> futures)
+{
+  using result_type = std::vector<pool_future<T>>;
+
+  for (const auto &future : futures)
+    future._check_state();
+
+  auto state = pool_future<result_type>::_make_state(this);
+  if (futures.empty()) {
+    pool_future<result_type>::_complete(*state, result_type(), nullptr);
+    return pool_future<result_type>(std::move(state));
+  }
+
+  // the join keeps the futures until the last of them gets ready, and hands
+  //  them over to the result.
+  struct join {
+    std::atomic<size_t> remaining;
+    result_type         futures;
+  };
+  auto shared = std::make_shared<join>();
+  shared->remaining.store(futures.size());
+  shared->futures = futures;
+
+  for (const auto &future : futures) {
+    future._on_ready([shared, state]() {
+      if (shared->remaining.fetch_sub(1) == 1)
+        pool_future<result_type>::_complete(
+            *state, std::move(shared->futures), nullptr);
+    });
+  }
+
+  return pool_future<result_type>(std::move(state));
+}
+
+template <typename T>
+pool_future<size_t>
+thread_pool::when_any(std::vector<pool_future<T>> futures)
+{
+  if (futures.empty())
+    throw std::invalid_argument("thread_pool::when_any: no future to wait for");
+  for (const auto &future : futures)
+    future._check_state();
+
+  auto state = pool_future<size_t>::_make_state(this);
+  auto done  = std::make_shared<std::atomic<bool>>(false);
+
+  for (size_t i = 0; i < futures.size(); ++i) {
+    futures[i]._on_ready([done, state, i]() {
+      if (!done->exchange(true))
+        pool_future<size_t>::_complete(*state, i, nullptr);
+    });
+  }
+
+  return pool_future<size_t>(std::move(state));
+}
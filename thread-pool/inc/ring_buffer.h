@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef> //size_t
+#include <utility> //move
+#include <vector>  //vector
+
+// ring_buffer is a FIFO queue stored in a single contiguous array, which
+//  doubles its capacity when it is full. Unlike std::queue - whose underlying
+//  std::deque allocates and frees a chunk every few hundred elements - it
+//  stops allocating once it has grown to the largest backlog seen so far.
+//  T must be DefaultConstructible and MoveAssignable.
+template <typename T>
+class ring_buffer {
+public:
+  explicit ring_buffer(size_t capacity = 64) : _items(capacity ? capacity : 1) {}
+
+  bool   empty() const { return _size == 0; }
+  size_t size() const { return _size; }
+
+  T &front() { return _items[_head]; }
+  T &back() { return _items[(_head + _size - 1) % _items.size()]; }
+
+  void push(T &&item) {
+    if (_size == _items.size())
+      _grow();
+
+    _items[(_head + _size) % _items.size()] = std::move(item);
+    ++_size;
+  }
+
+  T pop() {
+    T item = std::move(_items[_head]);
+    _head  = (_head + 1) % _items.size();
+    --_size;
+    return item;
+  }
+
+  // takes the most recently pushed item instead - LIFO.
+  T pop_back() {
+    T item = std::move(back());
+    --_size;
+    return item;
+  }
+
+private:
+  void _grow() {
+    std::vector<T> bigger(2 * _items.size());
+    for (size_t i = 0; i < _size; ++i)
+      bigger[i] = std::move(_items[(_head + i) % _items.size()]);
+
+    _items = std::move(bigger);
+    _head  = 0;
+  }
+
+  std::vector<T> _items;
+  size_t         _head{0};
+  size_t         _size{0};
+};
@@ -0,0 +1,196 @@
+#pragma once
+
+#include <coroutine>   //coroutine_handle, suspend_always, noop_coroutine
+#include <exception>   //exception_ptr, rethrow_exception
+#include <new>         //align_val_t
+#include <optional>    //optional
+#include <stdexcept>   //logic_error
+#include <type_traits> //conditional_t, is_void
+#include <utility>     //move, exchange
+#include <variant>     //monostate
+
+#include "block_pool.h"
+#include "threadpool.h"
+
+// task is a lazily started coroutine returning a T:
+//    task<int> answer(thread_pool &pool) {
+//      co_await pool.schedule(); // from here on, runs on a worker
+//      co_return 42;
+//    }
+//  Nothing runs until the task is co_awaited - from another task - or handed
+//  over to thread_pool::spawn, which returns a pool_future of its result.
+//  co_await transfers control straight to the awaited task, and back to the
+//  awaiting one once it ends (symmetric transfer): a chain of awaits never
+//  grows the stack, and resuming does not go through the pool.
+//  Coroutine frames are carved out of block_pool.
+template <typename T = void>
+class task {
+public:
+  static_assert(!std::is_reference_v<T>, "task does not support references");
+
+  class promise_type;
+  using _handle = std::coroutine_handle<promise_type>;
+
+  task(task &&other) noexcept
+      : _coroutine(std::exchange(other._coroutine, nullptr)) {}
+  task &operator=(task &&other) noexcept {
+    if (this != &other) {
+      if (_coroutine)
+        _coroutine.destroy();
+      _coroutine = std::exchange(other._coroutine, nullptr);
+    }
+    return *this;
+  }
+  ~task() {
+    if (_coroutine)
+      _coroutine.destroy();
+  }
+
+  // a task is awaited at most once: co_await moves its result out. Awaiting
+  //  a moved-from task throws std::logic_error.
+  auto operator co_await() && noexcept { return _awaiter{_coroutine}; }
+
+private:
+  using _value_type = std::conditional_t<std::is_void_v<T>, std::monostate, T>;
+
+  explicit task(_handle coroutine) : _coroutine(coroutine) {}
+
+  // at its final suspension point, a task resumes whoever awaited it.
+  struct _final_awaiter {
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(_handle coroutine) noexcept {
+      if (auto continuation = coroutine.promise()._continuation)
+        return continuation;
+      return std::noop_coroutine();
+    }
+    void await_resume() const noexcept {}
+  };
+
+  struct _awaiter {
+    _handle coroutine;
+
+    bool await_ready() const noexcept { return !coroutine || coroutine.done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) {
+      coroutine.promise()._continuation = awaiting;
+      return coroutine;
+    }
+    T await_resume() {
+      if (!coroutine)
+        throw std::logic_error("task: awaiting a moved-from task");
+      return coroutine.promise()._result();
+    }
+  };
+
+  // return_value and return_void cannot both be declared by a promise: they
+  //  live in a base, specialized for void.
+  template <typename U, typename = void>
+  struct _returns {
+    std::optional<_value_type> value;
+    void return_value(U result) { value.emplace(std::move(result)); }
+  };
+  template <typename U>
+  struct _returns<U, std::enable_if_t<std::is_void_v<U>>> {
+    std::optional<_value_type> value;
+    void return_void() { value.emplace(); }
+  };
+
+  _handle _coroutine;
+};
+
+template <typename T>
+class task<T>::promise_type : public task<T>::template _returns<T> {
+public:
+  task get_return_object() { return task(_handle::from_promise(*this)); }
+
+  std::suspend_always initial_suspend() const noexcept { return {}; }
+  _final_awaiter      final_suspend() const noexcept { return {}; }
+
+  void unhandled_exception() { _error = std::current_exception(); }
+
+  // frames needing more than std::max_align_t - which block_pool does not
+  //  guarantee - go through the aligned global operators.
+  static void *operator new(size_t size) { return block_pool::allocate(size); }
+  static void *operator new(size_t size, std::align_val_t alignment) {
+    return ::operator new(size, alignment);
+  }
+  static void operator delete(void *ptr, size_t size) {
+    block_pool::deallocate(ptr, size);
+  }
+  static void operator delete(void *ptr, size_t size,
+                              std::align_val_t alignment) {
+    ::operator delete(ptr, size, alignment);
+  }
+
+private:
+  friend class task;
+
+  T _result() {
+    if (_error)
+      std::rethrow_exception(_error);
+    if constexpr (!std::is_void_v<T>)
+      return std::move(*this->value);
+  }
+
+  std::coroutine_handle<> _continuation;
+  std::exception_ptr      _error;
+};
+
+// the coroutine spawn runs a task in: it is started right away, and its
+//  frame frees itself once it is over.
+struct thread_pool::_detached {
+  struct promise_type {
+    _detached get_return_object() const noexcept { return {}; }
+
+    std::suspend_never initial_suspend() const noexcept { return {}; }
+    std::suspend_never final_suspend() const noexcept { return {}; }
+
+    void return_void() const noexcept {}
+    void unhandled_exception() const noexcept { std::terminate(); }
+
+    static void *operator new(size_t size) {
+      return block_pool::allocate(size);
+    }
+    static void *operator new(size_t size, std::align_val_t alignment) {
+      return ::operator new(size, alignment);
+    }
+    static void operator delete(void *ptr, size_t size) {
+      block_pool::deallocate(ptr, size);
+    }
+    static void operator delete(void *ptr, size_t size,
+                                std::align_val_t alignment) {
+      ::operator delete(ptr, size, alignment);
+    }
+  };
+};
+
+template <typename T>
+pool_future<T> thread_pool::spawn(task<T> coroutine)
+{
+  auto state = pool_future<T>::_make_state(this);
+  _drive(*this, std::move(coroutine), state);
+  return pool_future<T>(std::move(state));
+}
+
+template <typename T>
+thread_pool::_detached
+thread_pool::_drive(thread_pool &pool, task<T> coroutine,
+                    typename pool_future<T>::_state_ptr state)
+{
+  std::optional<typename pool_future<T>::_value_type> value;
+  std::exception_ptr                                  error;
+  try {
+    // throws task_cancelled if the pool is shut down before we start.
+    co_await pool.schedule();
+
+    if constexpr (std::is_void_v<T>) {
+      co_await std::move(coroutine);
+      value.emplace();
+    } else {
+      value.emplace(co_await std::move(coroutine));
+    }
+  } catch (...) {
+    error = std::current_exception();
+  }
+
+  pool_future<T>::_complete(*state, std::move(value), std::move(error));
+}
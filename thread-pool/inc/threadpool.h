@@ -1,16 +1,196 @@
 #pragma once
 
+#include <algorithm>          //min, max, stable_partition
+#include <atomic>             //atomic
+#include <chrono>             //microseconds
 #include <condition_variable> //condition_variable
-#include <future>             //packaged_task
-#include <mutex>              //unique_lock
-#include <queue>              //queue
+#include <coroutine>          //coroutine_handle
+#include <cstddef>            //nullptr_t
+#include <cstdint>            //uint64_t
+#include <exception>          //exception_ptr, rethrow_exception
+#include <future>             //promise, future, future_status
+#include <iterator>           //iterator_traits, distance
+#include <memory>             //unique_ptr
+#include <mutex>              //unique_lock, once_flag
+#include <new>                //align_val_t
+#include <optional>           //optional
+#include <stdexcept>          //runtime_error
+#include <stop_token>         //stop_source, stop_token
 #include <thread>             //thread
+#include <tuple>              //make_tuple, apply
 #include <type_traits>        //invoke_result, enable_if, is_invocable
+#include <utility>            //pair, move, forward
 #include <vector>             //vector
 
+#include "block_pool.h"
+#ifdef THREAD_POOL_STATS
+#include "latency_histogram.h"
+#endif
+#include "ring_buffer.h"
+#include "work_stealing_deque.h"
+
+template <typename T> class pool_future;
+template <typename T> class task;
+
+// whether a thread_pool can run function with args: as function(args...),
+//  or as function(stop_token, args...) - see thread_pool::get_stop_token.
+template <typename F, typename... Args>
+inline constexpr bool is_pool_invocable_v =
+    std::is_invocable_v<F &&, Args &&...> ||
+    std::is_invocable_v<F &&, std::stop_token, Args &&...>;
+
 class thread_pool {
 public:
-  thread_pool( size_t thread_count = std::thread::hardware_concurrency() );
+  // fifo          : every task goes through the shared queue and is served in
+  //                  submission order.
+  // work_stealing : tasks submitted from a worker go to that worker's own
+  //                  deque instead of the shared queue. Workers pop their own
+  //                  deque first (LIFO), then the shared queue, and finally
+  //                  steal from their peers (FIFO) - so that recursive
+  //                  workloads do not all contend on a single mutex.
+  enum class scheduling { fifo, work_stealing };
+
+  // what a worker does when it runs out of tasks, before blocking on the
+  //  condition_variable - which costs a futex syscall on both sides and
+  //  several microseconds of wakeup latency. It first polls spin_count times,
+  //  with a cpu pause between two polls, then yield_count times, yielding
+  //  its time slice between two polls. Both default to 0: park right away.
+  struct idle_policy {
+    size_t spin_count  = 0;
+    size_t yield_count = 0;
+  };
+
+  // how many times idle workers found a task while spinning, while
+  //  yielding, and how many times they parked.
+  struct idle_stats {
+    size_t spin_hits  = 0;
+    size_t yield_hits = 0;
+    size_t parks      = 0;
+  };
+
+#ifdef THREAD_POOL_STATS
+  // what a worker did since it was first started - see statistics().
+  //  wait_time : from the submission of a task to its start
+  //  run_time  : from the start of a task to its end
+  //  steals    : tasks taken from the deque of another worker
+  //  idle_time : time spent looking for - or waiting for - a task
+  //  Tasks that threads outside the pool run while they wait are not
+  //  accounted for.
+  struct worker_stats {
+    size_t                   executed  = 0;
+    size_t                   steals    = 0;
+    std::chrono::nanoseconds idle_time = {};
+    latency_histogram        wait_time;
+    latency_histogram        run_time;
+
+    worker_stats &operator+=(const worker_stats &other);
+  };
+
+  // queued : tasks submitted but not started yet, all queues included
+  // workers: one entry per worker slot ever started, retired ones included
+  struct pool_stats {
+    size_t                    queued = 0;
+    std::vector<worker_stats> workers;
+
+    worker_stats total() const;
+  };
+#endif
+
+  // tasks submitted with a priority - or a deadline - go through the shared
+  //  queues, never through the workers' deques. Deadline tasks are served
+  //  first, earliest deadline first, then high, normal and low priority
+  //  tasks - in submission order within a priority. Plain execute() calls
+  //  submit normal priority tasks.
+  enum class priority { high, normal, low };
+
+  // what a submission does when the pool already holds options::capacity
+  //  queued tasks:
+  //  block       : waits until workers have made room
+  //  fail        : throws queue_full
+  //  caller_runs : runs the task on the submitting thread
+  //  drop_oldest : cancels the oldest queued task - the one that would have
+  //                 run next - to make room, as shutdown_now would
+  //  A task of the pool cannot wait for room - its worker may be the one
+  //  meant to make it - nor lose its subtasks, or those of another task: on
+  //  a worker, every policy behaves as caller_runs.
+  enum class overflow { block, fail, caller_runs, drop_oldest };
+
+  // starvation_limit : a non-empty level is passed over at most that many
+  //                     times in a row in favour of more urgent tasks, after
+  //                     which one of its tasks is served. 0 means strict
+  //                     priorities, where low priority tasks may starve.
+  // cpus         : the cpus workers are pinned to - worker i running on
+  //                 cpus[i % cpus.size()]. Empty, workers are not pinned.
+  // numa_aware   : gives each NUMA node its own shared queue. Workers belong
+  //                 to the node of their cpu or, when cpus is empty, are
+  //                 spread over the nodes and pinned to the cpus of their
+  //                 node. They serve their node's queue before the others',
+  //                 and steal from workers of their node first.
+  //                 Nodes are read from sysfs: without it, there is one node.
+  //  Pinning is best effort: a cpu the process may not run on is ignored.
+  // max_threads  : upper bound for resize() and for the elastic mode. 0
+  //                 means thread_count.
+  // elastic      : lets the pool size itself between thread_count and
+  //                 max_threads. A supervisor thread adds a worker whenever
+  //                 tasks are pending and none was dequeued for a whole
+  //                 stall_timeout - typically because every worker is blocked
+  //                 on I/O -, and workers above thread_count retire after
+  //                 staying parked for idle_timeout.
+  // capacity     : how many tasks may be queued - submitted but not started
+  //                 yet - before on_full applies. 0 means unbounded.
+  // batch_size   : how many tasks a worker takes from a shared queue each
+  //                 time it locks it. The extra ones go to the worker's
+  //                 deque, where idle workers may steal them. A worker takes
+  //                 at most its share of the queue - its size divided by the
+  //                 number of workers - and only from the most urgent level
+  //                 holding tasks, never more than one deadline task.
+  //                 Priorities stay strict for the batch owner, which serves
+  //                 more urgent shared tasks before its deque. They are
+  //                 relaxed for the others: a batch may be stolen and run
+  //                 while more urgent tasks, submitted since, are queued -
+  //                 and tasks of a batch may run before the tasks of their
+  //                 level submitted earlier to another node. 1 disables
+  //                 batching.
+  struct options {
+    size_t                    thread_count     = std::thread::hardware_concurrency();
+    scheduling                policy           = scheduling::fifo;
+    idle_policy               idle;
+    std::vector<int>          cpus;
+    bool                      numa_aware       = false;
+    size_t                    starvation_limit = 32;
+    size_t                    max_threads      = 0;
+    bool                      elastic          = false;
+    std::chrono::microseconds stall_timeout    = std::chrono::milliseconds(1);
+    std::chrono::milliseconds idle_timeout     = std::chrono::seconds(10);
+    size_t                    capacity         = 0;
+    overflow                  on_full          = overflow::block;
+    size_t                    batch_size       = 8;
+  };
+
+  // a hint telling execute which NUMA node should run a task - typically the
+  //  one whose memory holds the task's data. Nodes are numbered as in sysfs.
+  struct locality {
+    size_t node;
+  };
+
+  // the exception that the future of a task holds when the pool drops the
+  //  task instead of running it - see shutdown_now.
+  class task_cancelled : public std::runtime_error {
+  public:
+    task_cancelled() : std::runtime_error("thread_pool: task cancelled") {}
+  };
+
+  // thrown by submissions to a full pool whose on_full is overflow::fail.
+  class queue_full : public std::runtime_error {
+  public:
+    queue_full() : std::runtime_error("thread_pool: queue full") {}
+  };
+
+  thread_pool( size_t     thread_count = std::thread::hardware_concurrency(),
+               scheduling policy       = scheduling::fifo );
+  explicit thread_pool( const options &opts );
+
+  // shuts the pool down - see shutdown - unless it already is.
   ~thread_pool();
 
   // since std::thread objects are not copiable, it doesn't make sense for a
@@ -19,10 +199,179 @@ public:
   thread_pool &operator=(const thread_pool& ) = delete;
 
   template <typename F, typename... Args,
-            std::enable_if_t<std::is_invocable_v<F &&, Args &&...>, int> = 0>
+            std::enable_if_t<is_pool_invocable_v<F, Args...>, int> = 0>
   auto execute(F &&, Args &&...);
 
+  // tasks without a hint go to the node the submitting thread runs on.
+  template <typename F, typename... Args,
+            std::enable_if_t<is_pool_invocable_v<F, Args...>, int> = 0>
+  auto execute(locality, F &&, Args &&...);
+
+  template <typename F, typename... Args,
+            std::enable_if_t<is_pool_invocable_v<F, Args...>, int> = 0>
+  auto execute(priority, F &&, Args &&...);
+
+  template <typename F, typename... Args,
+            std::enable_if_t<is_pool_invocable_v<F, Args...>, int> = 0>
+  auto execute(std::chrono::steady_clock::time_point deadline, F &&,
+               Args &&...);
+
+  // try_execute is execute without waiting: if the pool is at capacity, the
+  //  task is not submitted, and an empty optional is returned - whatever
+  //  on_full says.
+  template <typename F, typename... Args,
+            std::enable_if_t<is_pool_invocable_v<F, Args...>, int> = 0>
+  auto try_execute(F &&, Args &&...);
+
+  // post is the fire-and-forget counterpart of execute: no promise, no future,
+  //  the result is discarded. Only the task container is allocated - from
+  //  block_pool. Since there is nobody to report an exception to, a task
+  //  posted this way must not throw: an escaping exception terminates the
+  //  program, as it would on a plain std::thread.
+  template <typename F, typename... Args,
+            std::enable_if_t<is_pool_invocable_v<F, Args...>, int> = 0>
+  void post(F &&, Args &&...);
+
+  // execute_batch submits many tasks at once: the shared queue is locked
+  //  once for all of them, and at most one notification per sleeping worker
+  //  is issued - instead of one lock and one notify_one per task.
+  //  The first overload runs every callable of [first, last), the second one
+  //  runs function(0), ..., function(count - 1) - function being copied into
+  //  every task. Futures are returned in submission order.
+  //  On a bounded pool, a batch is queued piecemeal as room is made. With
+  //  overflow::fail, part of it may have been submitted when queue_full is
+  //  thrown.
+  template <typename It,
+            std::enable_if_t<std::is_invocable_v<
+                                 typename std::iterator_traits<It>::reference>,
+                             int> = 0>
+  auto execute_batch(It first, It last);
+
+  template <typename F,
+            std::enable_if_t<std::is_invocable_v<F &, size_t>, int> = 0>
+  auto execute_batch(size_t count, F &&function);
+
+  // a submit_buffer collects the tasks a thread submits, and hands them
+  //  over to the pool all at once - one lock, one wake-up round - when it
+  //  holds capacity of them, on flush(), and when it is destroyed.
+  //  Until then, nothing runs them: waiting for one of their futures before
+  //  flushing never returns. A buffer belongs to a single thread.
+  //  Tasks that the destructor fails to submit - with overflow::fail - are
+  //  dropped, and their futures report a broken promise: flush first.
+  class submit_buffer;
+
+  // sum of the idle counters of every worker.
+  idle_stats idle_statistics() const;
+
+#ifdef THREAD_POOL_STATS
+  // a snapshot of the per-worker counters. Only built with THREAD_POOL_STATS
+  //  defined, which costs a few clock reads per task: without it, neither the
+  //  counters nor this function exist. Counters are read one by one while
+  //  workers keep updating them, so a snapshot is not an atomic cut.
+  pool_stats statistics() const;
+#endif
+
+  // shutdown stops the pool once every pending task has run - tasks
+  //  submitted by running tasks included - and returns when every worker
+  //  has exited. shutdown_now cancels pending tasks instead: their futures
+  //  hold task_cancelled, and posted tasks are dropped. Tasks already running
+  //  are not interrupted, but a stop is requested on get_stop_token().
+  //  Once the pool is shut down, tasks submitted to it are cancelled right
+  //  away. Either function may be called several times - shutdown_now
+  //  cutting short a shutdown in progress - but not from a task of the pool,
+  //  which would wait for itself: that throws std::logic_error.
+  void shutdown();
+  void shutdown_now();
+
+  // the token shutdown_now requests a stop on. Like std::jthread, the pool
+  //  hands it to the callables it runs - through execute, try_execute, post,
+  //  spawn and submit_buffer - that take a std::stop_token before their
+  //  arguments: a long-running task may then poll it, or register a
+  //  std::stop_callback on it.
+  std::stop_token get_stop_token() const { return _stop_source.get_token(); }
+
+  // number of shared queues - one per NUMA node when numa_aware, else one.
+  size_t node_count() const;
+
+  // number of workers the pool is running - or converging to, after a
+  //  resize() or in elastic mode.
+  size_t thread_count() const;
+
+  // starts or retires workers until thread_count of them run. A worker being
+  //  retired first finishes its current task and hands the content of its
+  //  deque over to the shared queue. Throws std::out_of_range unless
+  //  0 < thread_count <= options::max_threads, and std::logic_error once the
+  //  pool is shutting down - from a task still running then, too.
+  void resize(size_t thread_count);
+
+  // parallel_for calls function(i) for every i of [first, last) - Index being
+  //  an integral type or a random access iterator - and returns once every
+  //  call is done. The range is split lazily (see "Lazy Binary Splitting",
+  //  Tzannes et al., PPoPP 2010): a task handles its range chunk by chunk,
+  //  and only hands the upper half of what is left over to the pool when no
+  //  other task is pending - that is, when a worker may be idle. The calling
+  //  thread takes part in the loop, then runs pending tasks until it is over.
+  //  If function throws, the remaining iterations are skipped and the first
+  //  exception is rethrown by parallel_for.
+  template <typename Index, typename F>
+  void parallel_for(Index first, Index last, F &&function);
+
+  // parallel_reduce returns combine(identity, function(i)) folded over every
+  //  i of [first, last), split the same way as parallel_for. Partial results
+  //  are combined in no particular order: combine must be associative and
+  //  commutative, and identity neutral for it.
+  template <typename Index, typename T, typename F, typename Combine>
+  T parallel_reduce(Index first, Index last, T identity, F &&function,
+                    Combine &&combine);
+
+  // spawn is the pool_future counterpart of execute: the returned future
+  //  accepts continuations - see pool_future.h - which are scheduled on the
+  //  pool once it is ready, instead of blocking a thread on get().
+  template <typename F, typename... Args,
+            std::enable_if_t<is_pool_invocable_v<F, Args...>, int> = 0>
+  auto spawn(F &&, Args &&...);
+
+  // runs a coroutine - see task.h - on the pool, and returns the future of
+  //  its result.
+  template <typename T>
+  pool_future<T> spawn(task<T> coroutine);
+
+  // co_await pool.schedule() suspends the calling coroutine and resumes it
+  //  on a worker of the pool.
+  auto schedule();
+
+  // when_all returns a future that gets ready - holding futures, all of them
+  //  ready - once every future of futures is. when_any returns a future
+  //  holding the index of the first future of futures to be ready. Both
+  //  throw future_errc::no_state if one of futures is not valid.
+  template <typename T>
+  pool_future<std::vector<pool_future<T>>>
+  when_all(std::vector<pool_future<T>> futures);
+
+  template <typename T>
+  pool_future<size_t> when_any(std::vector<pool_future<T>> futures);
+
+  // wait blocks until future - a std::future or std::shared_future, such as
+  //  the ones execute returns - is ready. On a worker of the pool, runs
+  //  pending tasks of the pool in the meantime: a task may thus wait for the
+  //  subtasks it submitted without tying up its worker - with plain
+  //  future.get(), as many nested waits as workers deadlock the pool. A
+  //  deferred future is run right away. get is wait followed by
+  //  future.get().
+  //  pool_future::wait and get do the same on their own when called on a
+  //  worker of their pool.
+  template <typename Future>
+  void wait(const Future &future);
+
+  template <typename T>
+  T get(std::future<T> &future);
+
+  template <typename T>
+  T get(std::future<T> &&future) { return get(future); }
+
 private:
+  template <typename> friend class pool_future;
+
   //_task_container_base and _task_container exist simply as a wrapper around a
   //  MoveConstructible - but not CopyConstructible - Callable object. Since an
   //  std::function requires a given Callable to be CopyConstructible, we
@@ -38,6 +387,41 @@ private:
     virtual ~_task_container_base(){};
 
     virtual void operator()() = 0;
+
+    // called instead of operator() when the pool drops the task. Tasks with
+    //  a future complete it with task_cancelled, others do nothing.
+    virtual void cancel() {}
+
+    // containers are carved out of block_pool. Since the destructor is
+    //  virtual, the sized operator delete is handed the size of the most
+    //  derived _task_container, which tells block_pool the size class to
+    //  put the block back into. block_pool blocks are only aligned for
+    //  std::max_align_t: containers of over-aligned callables go through the
+    //  aligned global operators instead.
+    static void *operator new(size_t size) {
+      return block_pool::allocate(size);
+    }
+    static void *operator new(size_t size, std::align_val_t alignment) {
+      return ::operator new(size, alignment);
+    }
+    static void operator delete(void *ptr, size_t size) {
+      block_pool::deallocate(ptr, size);
+    }
+    static void operator delete(void *ptr, size_t size,
+                                std::align_val_t alignment) {
+      ::operator delete(ptr, size, alignment);
+    }
+
+    // the level of the shared queue the task was last queued at: batched
+    //  tasks keep it while they wait in a deque - see _retire.
+    size_t level = 1 + size_t(priority::normal);
+
+#ifdef THREAD_POOL_STATS
+    // set again when the task is queued - a continuation, for one, is
+    //  created long before.
+    std::chrono::steady_clock::time_point enqueued =
+        std::chrono::steady_clock::now();
+#endif
   };
   using _task_ptr = std::unique_ptr<_task_container_base>;
 
@@ -56,40 +440,719 @@ private:
 
     void operator()() override { _f(); }
 
+    void cancel() override {
+      if constexpr (requires(F &f) { f.cancel(); })
+        _f.cancel();
+    }
+
   private:
     F _f;
   };
 
-  std::vector<std::thread> _threads;
-  std::queue<_task_ptr>    _tasks;
-  std::mutex               _task_mutex;
-  std::condition_variable  _task_cv;
-  bool                     _stop_threads{false};
+  // the callable that execute wraps into a task container: runs function
+  //  and fulfils promise with its outcome.
+  template <typename R, typename F>
+  struct _promised_call {
+    std::promise<R> promise;
+    F               function;
+
+    void operator()() { _fulfil(promise, function); }
+    void cancel() {
+      promise.set_exception(std::make_exception_ptr(task_cancelled()));
+    }
+  };
+
+#ifdef THREAD_POOL_STATS
+  // the counters behind worker_stats. Only their worker writes them - with a
+  //  plain load and store rather than a read-modify-write - while
+  //  statistics() may read them from any thread.
+  struct _counters {
+    std::atomic<uint64_t> executed{0};
+    std::atomic<uint64_t> steals{0};
+    std::atomic<uint64_t> idle_ns{0};
+    std::atomic<uint64_t> wait_time[latency_histogram::bucket_count]{};
+    std::atomic<uint64_t> run_time[latency_histogram::bucket_count]{};
+
+    // when the worker last became idle - touched by the worker only.
+    std::chrono::steady_clock::time_point idle_since;
+
+    static void bump(std::atomic<uint64_t> &counter, uint64_t count = 1) {
+      counter.store(counter.load(std::memory_order_relaxed) + count,
+                    std::memory_order_relaxed);
+    }
+  };
+#endif
+
+  // a worker owns a thread and the deque it pushes its own submissions to.
+  //  Its tasks are stored as raw pointers, released from - and turned back
+  //  into - _task_ptr on their way in and out of the deque.
+  struct _worker {
+    work_stealing_deque<_task_container_base> tasks;
+    std::thread                               thread;
+    size_t                                    node{0};
+    std::vector<int>                          cpus;
+
+    // the other workers, those of the same node first.
+    std::vector<size_t>                       victims;
+
+    // room for the extra tasks of a batch, on their way to the deque.
+    std::vector<_task_ptr>                    batch;
+
+    // whether a thread runs - or is about to run - this worker. Guarded by
+    //  _task_mutex.
+    bool                                      running{false};
+
+    // written by the worker only, read by idle_statistics().
+    std::atomic<size_t>                       spin_hits{0};
+    std::atomic<size_t>                       yield_hits{0};
+    std::atomic<size_t>                       parks{0};
+
+#ifdef THREAD_POOL_STATS
+    _counters                                 counters;
+#endif
+  };
+
+  static constexpr size_t _any_node = static_cast<size_t>(-1);
+
+  // where a task should go: a node - _any_node letting the pool choose - and
+  //  a level of its shared queue, level 0 being the deadline level and the
+  //  others matching the priority enum shifted by one.
+  struct _target {
+    size_t                                node     = _any_node;
+    size_t                                level    = 1 + size_t(priority::normal);
+    std::chrono::steady_clock::time_point deadline = {};
+  };
+
+  // the shared queue of a NUMA node: one FIFO per priority, plus a heap of
+  //  deadline tasks. Every member but size is guarded by mutex. size mirrors
+  //  the number of queued tasks, so that workers can skip empty queues
+  //  without locking them.
+  class _node_queue {
+  public:
+    std::mutex          mutex;
+    std::atomic<size_t> size{0};
+
+    void      push(_task_ptr task, const _target &target);
+
+    // newest pops the back of the FIFO being served instead of its front.
+    _task_ptr pop(size_t starvation_limit, bool newest = false);
+
+    // pops up to count more tasks - oldest first - from the FIFO that the
+    //  last pop served. None if it served a deadline task - deadlines are
+    //  only ordered within the queue - or a level passed over too long.
+    //  Fewer if one more task would starve a less urgent level.
+    size_t    pop_batch(_task_ptr *tasks, size_t count,
+                        size_t starvation_limit);
+
+    // whether a task more urgent than level is queued. Read without the
+    //  lock, like size.
+    bool      has_urgent(size_t level) const;
+
+  private:
+    static constexpr size_t _levels = 4;
+
+    struct _deadline_task {
+      std::chrono::steady_clock::time_point deadline;
+      size_t                                sequence;
+      _task_ptr                             task;
+
+      // std heaps are max-heaps: the "greatest" task is the most urgent one.
+      bool operator<(const _deadline_task &other) const {
+        return deadline != other.deadline ? deadline > other.deadline
+                                           : sequence > other.sequence;
+      }
+    };
+
+    bool _empty(size_t level) const;
+
+    std::vector<_deadline_task> _deadlines;
+    ring_buffer<_task_ptr>      _fifos[_levels - 1];
+    size_t                      _skipped[_levels]{};
+    size_t                      _sequence{0};
+    size_t                      _served{0};
+    bool                        _batchable{false};
+    std::atomic<size_t>         _counts[_levels]{};
+  };
+
+  void      _enqueue(_task_ptr task);
+  void      _enqueue(_task_ptr task, const _target &target);
+  void      _enqueue_all(_task_ptr *tasks, size_t count);
+  void      _enqueue_all(_task_ptr *tasks, size_t count,
+                         const _target &target);
+  void      _publish(_task_ptr *tasks, size_t count, const _target &target);
+  size_t    _reserve(size_t count);
+  void      _wait_for_room();
+  size_t    _node_of(int cpu) const;
+  size_t    _home_node() const;
+  void      _wake(size_t count);
+  bool      _run_pending_task();
+  void      _cancel_pending();
+  void      _stop();
+  void      _run_task(_task_container_base &task, size_t index);
+  bool      _on_worker() const;
+  _task_ptr _take_task(size_t index, bool newest = false);
+  void      _run_worker(size_t index);
+  bool      _retire(size_t index);
+  void      _resize(size_t thread_count);
+  void      _supervise();
+  bool      _wait_for_work(_worker &worker) const;
+
+  // what schedule() returns: resuming the coroutine is queued as a task. If
+  //  the pool cancels that task, the coroutine is resumed all the same, and
+  //  co_await throws task_cancelled.
+  class _scheduler {
+  public:
+    explicit _scheduler(thread_pool &pool) : _pool(pool) {}
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> coroutine) {
+      // once queued, the coroutine may resume - and this awaiter, which is
+      //  part of its frame, vanish - before _enqueue even returns.
+      _pool._enqueue(_task_ptr(new _task_container(_resume{this, coroutine})));
+    }
+    void await_resume() const {
+      if (_cancelled)
+        throw task_cancelled();
+    }
+
+  private:
+    struct _resume {
+      _scheduler             *awaiter;
+      std::coroutine_handle<> coroutine;
+
+      void operator()() { coroutine.resume(); }
+      void cancel() {
+        awaiter->_cancelled = true;
+        coroutine.resume();
+      }
+    };
+
+    thread_pool &_pool;
+    bool         _cancelled{false};
+  };
+
+  // the fire-and-forget coroutine type of _drive, which runs the task given
+  //  to spawn and fulfils its future - both defined in task.h.
+  struct _detached;
+
+  template <typename T>
+  static _detached _drive(thread_pool &pool, task<T> coroutine,
+                          typename pool_future<T>::_state_ptr state);
+
+  // callables taking a std::stop_token first are handed get_stop_token()
+  //  ahead of their arguments.
+  template <typename F, typename... Args>
+  static constexpr bool _takes_stop_token =
+      std::is_invocable_v<F &&, std::stop_token, Args &&...>;
+
+  template <typename F, typename... Args>
+  using _invoke_result_t = typename std::conditional_t<
+      _takes_stop_token<F, Args...>,
+      std::invoke_result<F, std::stop_token, Args...>,
+      std::invoke_result<F, Args...>>::type;
+
+  // the callable a task runs: function applied to its arguments - preceded
+  //  by the stop token if function takes one.
+  template <typename F, typename... Args>
+  auto _bind(F &&function, Args &&...args) const;
+
+  // wraps function and its arguments into a task container that fulfils a
+  //  promise, and returns the container along with the matching future.
+  template <typename F, typename... Args>
+  auto _make_task(F &&function, Args &&...args) const;
+
+  // runs function and stores its outcome - value or exception - in promise.
+  template <typename R, typename F>
+  static void _fulfil(std::promise<R> &promise, F &function);
+
+  // the state shared by the tasks of a parallel_for or parallel_reduce call.
+  //  It lives on the stack of the calling thread, which only returns once
+  //  every iteration has been accounted for in _remaining.
+  //  parallel_for has no result to combine: it passes nullptr_t for both T
+  //  and Combine.
+  template <typename Index, typename T, typename F, typename Combine>
+  class _loop {
+  public:
+    _loop(thread_pool &pool, Index first, Index last, T identity,
+          F &function, Combine &combine);
+
+    T run();
+
+  private:
+    static constexpr bool _reduces = !std::is_same_v<Combine, std::nullptr_t>;
+
+    void _run(Index first, Index last);
+    void _split_off(Index first, Index last);
+    void _fail(std::exception_ptr error);
+
+    // the task a split off range runs in. When it is cancelled, the loop
+    //  fails with task_cancelled, and the range counts as done.
+    struct _chunk {
+      _loop *loop;
+      Index  first;
+      Index  last;
+
+      void operator()() { loop->_run(first, last); }
+      void cancel() {
+        loop->_fail(std::make_exception_ptr(task_cancelled()));
+        loop->_run(first, last);
+      }
+    };
+
+    thread_pool            &_pool;
+    F                      &_function;
+    Combine                &_combine;
+    const Index             _first;
+    const Index             _last;
+    const T                 _identity;
+    T                       _result;
+    size_t                  _grain;
+    std::atomic<size_t>     _remaining;
+    std::atomic<bool>       _failed{false};
+    std::exception_ptr      _error;
+    std::mutex              _mutex;
+    std::condition_variable _done_cv;
+    bool                    _done{false};
+  };
+
+  const scheduling                          _policy;
+  const idle_policy                         _idle;
+  const size_t                              _starvation_limit;
+  const size_t                              _min_threads;
+  const bool                                _elastic;
+  const std::chrono::microseconds           _stall_timeout;
+  const std::chrono::milliseconds           _idle_timeout;
+  std::vector<std::unique_ptr<_worker>>     _workers;
+  std::vector<std::unique_ptr<_node_queue>> _queues;
+  std::vector<size_t>                       _cpu_nodes;
+
+  // guards the setting of _stop_threads, the parking of workers on _task_cv,
+  //  and changes to _thread_target.
+  std::mutex                                _task_mutex;
+  std::condition_variable                   _task_cv;
+  std::atomic<bool>                         _stop_threads{false};
+
+  // set by shutdown_now, or once the workers are gone: tasks are cancelled
+  //  instead of run. _joined makes sure threads are joined only once.
+  std::atomic<bool>                         _cancelling{false};
+  std::stop_source                          _stop_source;
+  std::once_flag                            _joined;
+
+  // _workers holds max_threads slots, allocated upfront so that thieves can
+  //  walk them without synchronization. Workers whose index is past
+  //  _thread_target retire, _started is one past the highest slot ever
+  //  started, and _resize_mutex serializes the starting of threads.
+  std::atomic<size_t>                       _thread_target{0};
+  std::atomic<size_t>                       _started{0};
+  std::mutex                                _resize_mutex;
+  std::thread                               _supervisor;
+  std::condition_variable                   _supervisor_cv;
+
+  // number of tasks sitting in any queue, and number of workers blocked on
+  //  _task_cv. Together they let a submitter skip the notification when
+  //  nobody sleeps, and a worker never sleep while a task is pending.
+  std::atomic<size_t>                       _pending{0};
+  std::atomic<size_t>                       _sleeping{0};
+
+  // when _pending reaches _capacity - if not 0 - submitters apply _on_full.
+  //  Those which block wait on _room_cv, under _task_mutex: _blocked tells
+  //  workers whether anyone needs to be notified when they take a task.
+  const size_t                              _capacity;
+  const overflow                            _on_full;
+  const size_t                              _batch_size;
+  std::condition_variable                   _room_cv;
+  std::atomic<size_t>                       _blocked{0};
+
+  // number of tasks ever dequeued - only counted in elastic mode, where the
+  //  supervisor watches it to detect a stalled pool.
+  std::atomic<size_t>                       _taken{0};
+};
+
+class thread_pool::submit_buffer {
+public:
+  explicit submit_buffer(thread_pool &pool, size_t capacity = 64);
+  ~submit_buffer();
+
+  submit_buffer(const submit_buffer& ) = delete;
+  submit_buffer &operator=(const submit_buffer& ) = delete;
+
+  template <typename F, typename... Args,
+            std::enable_if_t<is_pool_invocable_v<F, Args...>, int> = 0>
+  auto execute(F &&, Args &&...);
+
+  template <typename F, typename... Args,
+            std::enable_if_t<is_pool_invocable_v<F, Args...>, int> = 0>
+  void post(F &&, Args &&...);
+
+  void flush();
+
+private:
+  void _add(_task_ptr task);
+
+  thread_pool           &_pool;
+  const size_t           _capacity;
+  std::vector<_task_ptr> _tasks;
 };
 
 template <typename F, typename... Args,
-          std::enable_if_t<std::is_invocable_v<F &&, Args &&...>, int>>
+          std::enable_if_t<is_pool_invocable_v<F, Args...>, int>>
 auto thread_pool::execute(F &&function, Args &&...args) 
 {
-  std::unique_lock<std::mutex> queue_lock(_task_mutex, std::defer_lock);
-  std::packaged_task<std::invoke_result_t<F, Args...>()> task_pkg(
-      [_f = std::move(function),
-       _fargs = std::make_tuple(std::forward<Args>(args)...)]() mutable {
-        return std::apply(std::move(_f), std::move(_fargs));
-      });
-  std::future<std::invoke_result_t<F, Args...>> future = task_pkg.get_future();
+  auto [task, future] =
+      _make_task(std::forward<F>(function), std::forward<Args>(args)...);
+
+  _enqueue(std::move(task));
 
-  queue_lock.lock();
-  // this lambda move-captures the packaged_task declared above. Since the
-  //  packaged_task type is not CopyConstructible, the function is not
-  //  CopyConstructible either - hence the need for a _task_container to wrap
-  //  around it.
-  _tasks.emplace(_task_ptr(
-      new _task_container([task(std::move(task_pkg))]() mutable { task(); })));
+  return std::move(future);
+}
 
-  queue_lock.unlock();
+template <typename F, typename... Args,
+          std::enable_if_t<is_pool_invocable_v<F, Args...>, int>>
+auto thread_pool::execute(locality hint, F &&function, Args &&...args)
+{
+  auto [task, future] =
+      _make_task(std::forward<F>(function), std::forward<Args>(args)...);
 
-  _task_cv.notify_one();
+  _target target;
+  target.node = hint.node % _queues.size();
+  _enqueue(std::move(task), target);
 
   return std::move(future);
 }
+
+template <typename F, typename... Args,
+          std::enable_if_t<is_pool_invocable_v<F, Args...>, int>>
+auto thread_pool::execute(priority level, F &&function, Args &&...args)
+{
+  auto [task, future] =
+      _make_task(std::forward<F>(function), std::forward<Args>(args)...);
+
+  _target target;
+  target.level = 1 + size_t(level);
+  _enqueue(std::move(task), target);
+
+  return std::move(future);
+}
+
+template <typename F, typename... Args,
+          std::enable_if_t<is_pool_invocable_v<F, Args...>, int>>
+auto thread_pool::execute(std::chrono::steady_clock::time_point deadline,
+                          F &&function, Args &&...args)
+{
+  auto [task, future] =
+      _make_task(std::forward<F>(function), std::forward<Args>(args)...);
+
+  _target target;
+  target.level    = 0;
+  target.deadline = deadline;
+  _enqueue(std::move(task), target);
+
+  return std::move(future);
+}
+
+template <typename F, typename... Args>
+auto thread_pool::_bind(F &&function, Args &&...args) const
+{
+  using result_type = _invoke_result_t<F, Args...>;
+
+  auto fargs = [&]() {
+    if constexpr (_takes_stop_token<F, Args...>)
+      return std::make_tuple(get_stop_token(), std::forward<Args>(args)...);
+    else
+      return std::make_tuple(std::forward<Args>(args)...);
+  }();
+
+  return [_f = std::forward<F>(function), _fargs = std::move(fargs)]() mutable
+             -> result_type { return std::apply(std::move(_f), std::move(_fargs)); };
+}
+
+template <typename F, typename... Args>
+auto thread_pool::_make_task(F &&function, Args &&...args) const
+{
+  using result_type = _invoke_result_t<F, Args...>;
+
+  // a std::promise - unlike a std::packaged_task - accepts an allocator for
+  //  its shared state, which lets block_pool recycle it.
+  std::promise<result_type> promise(std::allocator_arg,
+                                    pool_allocator<result_type>());
+  std::future<result_type> future = promise.get_future();
+
+  // the call move-captures the promise declared above. Since the promise
+  //  type is not CopyConstructible, the call is not CopyConstructible
+  //  either - hence the need for a _task_container to wrap around it.
+  auto call = _bind(std::forward<F>(function), std::forward<Args>(args)...);
+  _task_ptr task(new _task_container(
+      _promised_call<result_type, decltype(call)>{std::move(promise),
+                                                  std::move(call)}));
+
+  return std::make_pair(std::move(task), std::move(future));
+}
+
+template <typename It,
+          std::enable_if_t<std::is_invocable_v<
+                               typename std::iterator_traits<It>::reference>,
+                           int>>
+auto thread_pool::execute_batch(It first, It last)
+{
+  using result_type =
+      std::invoke_result_t<typename std::iterator_traits<It>::reference>;
+
+  std::vector<_task_ptr>                tasks;
+  std::vector<std::future<result_type>> futures;
+  if constexpr (std::is_base_of_v<
+                    std::forward_iterator_tag,
+                    typename std::iterator_traits<It>::iterator_category>) {
+    tasks.reserve(std::distance(first, last));
+    futures.reserve(tasks.capacity());
+  }
+
+  for (; first != last; ++first) {
+    auto [task, future] = _make_task(*first);
+    tasks.push_back(std::move(task));
+    futures.push_back(std::move(future));
+  }
+
+  _enqueue_all(tasks.data(), tasks.size());
+
+  return futures;
+}
+
+template <typename F, std::enable_if_t<std::is_invocable_v<F &, size_t>, int>>
+auto thread_pool::execute_batch(size_t count, F &&function)
+{
+  using result_type = std::invoke_result_t<F &, size_t>;
+
+  std::vector<_task_ptr>                tasks;
+  std::vector<std::future<result_type>> futures;
+  tasks.reserve(count);
+  futures.reserve(count);
+
+  for (size_t i = 0; i < count; ++i) {
+    auto [task, future] = _make_task(function, i);
+    tasks.push_back(std::move(task));
+    futures.push_back(std::move(future));
+  }
+
+  _enqueue_all(tasks.data(), tasks.size());
+
+  return futures;
+}
+
+template <typename Index, typename F>
+void thread_pool::parallel_for(Index first, Index last, F &&function)
+{
+  std::nullptr_t no_combine;
+  _loop<Index, std::nullptr_t, F, std::nullptr_t>(*this, first, last, nullptr,
+                                                  function, no_combine)
+      .run();
+}
+
+template <typename Index, typename T, typename F, typename Combine>
+T thread_pool::parallel_reduce(Index first, Index last, T identity,
+                               F &&function, Combine &&combine)
+{
+  return _loop<Index, T, F, Combine>(*this, first, last, std::move(identity),
+                                     function, combine)
+      .run();
+}
+
+template <typename Index, typename T, typename F, typename Combine>
+thread_pool::_loop<Index, T, F, Combine>::_loop(thread_pool &pool,
+                                                Index first, Index last,
+                                                T identity, F &function,
+                                                Combine &combine)
+    : _pool(pool), _function(function), _combine(combine), _first(first),
+      _last(last), _identity(identity), _result(std::move(identity)),
+      _remaining(first < last ? static_cast<size_t>(last - first) : 0) {
+  // chunks are small enough for every worker - and the caller - to get a
+  //  few dozens of them: the splitting test being a single relaxed load,
+  //  it is cheap to run it often.
+  _grain = std::max<size_t>(1, _remaining / (64 * (pool.thread_count() + 1)));
+}
+
+template <typename Index, typename T, typename F, typename Combine>
+T thread_pool::_loop<Index, T, F, Combine>::run() {
+  if (_remaining.load() == 0)
+    return std::move(_result);
+
+  _run(_first, _last);
+
+  // help with whatever is pending - our own chunks, or anything else - until
+  //  the loop is over. When nothing can be taken, our remaining chunks are
+  //  running on other threads: wait a little for them to end or to split.
+  std::unique_lock<std::mutex> loop_lock(_mutex);
+  while (!_done) {
+    loop_lock.unlock();
+    bool helped = _pool._run_pending_task();
+    loop_lock.lock();
+
+    if (!helped)
+      _done_cv.wait_for(loop_lock, std::chrono::microseconds(100));
+  }
+
+  if (_error)
+    std::rethrow_exception(_error);
+
+  return std::move(_result);
+}
+
+template <typename Index, typename T, typename F, typename Combine>
+void thread_pool::_loop<Index, T, F, Combine>::_run(Index first, Index last) {
+  const Index start = first;
+  T           partial(_identity);
+
+  try {
+    while (first != last && !_failed.load(std::memory_order_relaxed)) {
+      const size_t left = static_cast<size_t>(last - first);
+
+      if (left > _grain && _pool._pending.load(std::memory_order_relaxed) == 0) {
+        Index middle = first + static_cast<decltype(last - first)>(left / 2);
+        _split_off(middle, last);
+        last = middle;
+        continue;
+      }
+
+      const Index chunk_end =
+          first + static_cast<decltype(last - first)>(std::min(left, _grain));
+      for (; first != chunk_end; ++first) {
+        if constexpr (_reduces)
+          partial = _combine(std::move(partial), _function(first));
+        else
+          _function(first);
+      }
+    }
+  } catch (...) {
+    _fail(std::current_exception());
+  }
+
+  if constexpr (_reduces) {
+    if (!_failed.load()) {
+      std::lock_guard<std::mutex> loop_lock(_mutex);
+      _result = _combine(std::move(_result), std::move(partial));
+    }
+  }
+
+  // we are accountable for [start, last): the ranges split off are accounted
+  //  for by their own task. Iterations skipped after a failure count as done.
+  const size_t count = static_cast<size_t>(last - start);
+  if (_remaining.fetch_sub(count) == count) {
+    // the caller may destroy *this as soon as it sees _done, hence the
+    //  notification under the lock.
+    std::lock_guard<std::mutex> loop_lock(_mutex);
+    _done = true;
+    _done_cv.notify_all();
+  }
+}
+
+template <typename Index, typename T, typename F, typename Combine>
+void thread_pool::_loop<Index, T, F, Combine>::_split_off(Index first,
+                                                          Index last) {
+  _pool._enqueue(_task_ptr(new _task_container(_chunk{this, first, last})));
+}
+
+template <typename Index, typename T, typename F, typename Combine>
+void thread_pool::_loop<Index, T, F, Combine>::_fail(std::exception_ptr error) {
+  std::lock_guard<std::mutex> loop_lock(_mutex);
+  if (!_error)
+    _error = std::move(error);
+  _failed.store(true);
+}
+
+template <typename F, typename... Args,
+          std::enable_if_t<is_pool_invocable_v<F, Args...>, int>>
+auto thread_pool::try_execute(F &&function, Args &&...args)
+{
+  auto [task, future] =
+      _make_task(std::forward<F>(function), std::forward<Args>(args)...);
+
+  std::optional<decltype(future)> submitted;
+  if (_reserve(1) == 1) {
+    _publish(&task, 1, _target());
+    submitted.emplace(std::move(future));
+  }
+  return submitted;
+}
+
+template <typename F, typename... Args,
+          std::enable_if_t<is_pool_invocable_v<F, Args...>, int>>
+void thread_pool::post(F &&function, Args &&...args)
+{
+  _enqueue(_task_ptr(new _task_container(
+      _bind(std::forward<F>(function), std::forward<Args>(args)...))));
+}
+
+template <typename F, typename... Args,
+          std::enable_if_t<is_pool_invocable_v<F, Args...>, int>>
+auto thread_pool::submit_buffer::execute(F &&function, Args &&...args)
+{
+  auto [task, future] =
+      _pool._make_task(std::forward<F>(function), std::forward<Args>(args)...);
+
+  _add(std::move(task));
+
+  return std::move(future);
+}
+
+template <typename F, typename... Args,
+          std::enable_if_t<is_pool_invocable_v<F, Args...>, int>>
+void thread_pool::submit_buffer::post(F &&function, Args &&...args)
+{
+  _add(_task_ptr(new _task_container(
+      _pool._bind(std::forward<F>(function), std::forward<Args>(args)...))));
+}
+
+template <typename R, typename F>
+void thread_pool::_fulfil(std::promise<R> &promise, F &function) {
+  try {
+    if constexpr (std::is_void_v<R>) {
+      function();
+      promise.set_value();
+    } else {
+      promise.set_value(function());
+    }
+  } catch (...) {
+    promise.set_exception(std::current_exception());
+  }
+}
+
+template <typename Future>
+void thread_pool::wait(const Future &future)
+{
+  if (!_on_worker()) {
+    future.wait();
+    return;
+  }
+
+  // when there is nothing to help with, the awaited task is running on
+  //  another thread - or blocked behind a task that is: wait a little for it,
+  //  then look for work again. A deferred future only runs in wait: no task
+  //  of ours can make it ready.
+  for (;;) {
+    const std::future_status status =
+        future.wait_for(std::chrono::seconds(0));
+    if (status == std::future_status::ready)
+      return;
+    if (status == std::future_status::deferred) {
+      future.wait();
+      return;
+    }
+
+    if (!_run_pending_task())
+      future.wait_for(std::chrono::microseconds(100));
+  }
+}
+
+template <typename T>
+T thread_pool::get(std::future<T> &future)
+{
+  wait(future);
+  return future.get();
+}
+
+inline auto thread_pool::schedule()
+{
+  return _scheduler(*this);
+}
+
+#include "pool_future.h"
+#include "task.h"
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <atomic>  //atomic, atomic_thread_fence
+#include <cstddef> //size_t
+#include <cstdint> //int64_t
+#include <memory>  //unique_ptr
+#include <vector>  //vector
+
+// work_stealing_deque is a Chase-Lev deque ("Dynamic Circular Work-Stealing
+//  Deque", Chase & Lev, SPAA 2005), using the memory orderings given in
+//  "Correct and Efficient Work-Stealing for Weak Memory Models" (Le et al.,
+//  PPoPP 2013).
+//  A single thread - the owner - pushes and pops at the bottom of the deque
+//  (LIFO), while any other thread may steal from its top (FIFO). The owner
+//  never takes a lock, and thieves only contend on a single CAS.
+//  The deque stores raw pointers and never owns the pointed-to objects.
+template <typename T>
+class work_stealing_deque {
+public:
+  explicit work_stealing_deque(size_t capacity = 256);
+
+  work_stealing_deque(const work_stealing_deque& ) = delete;
+  work_stealing_deque &operator=(const work_stealing_deque& ) = delete;
+
+  // owner only.
+  void push(T *item);
+  T   *pop();
+
+  // any thread. Returns nullptr if the deque is empty, or if another thread
+  //  won the race for the top item.
+  T   *steal();
+
+  bool   empty() const;
+  size_t size() const;
+
+private:
+  // circular buffer whose capacity is a power of two. Slots are atomics
+  //  because, after a wrap around, a thief may read a slot the owner is
+  //  writing - the thief then loses its CAS and discards what it read.
+  class _array {
+  public:
+    explicit _array(size_t capacity)
+        : _mask(capacity - 1), _items(new std::atomic<T *>[capacity]) {}
+
+    size_t capacity() const { return _mask + 1; }
+
+    T *get(int64_t i) const {
+      return _items[i & _mask].load(std::memory_order_relaxed);
+    }
+
+    void put(int64_t i, T *item) {
+      _items[i & _mask].store(item, std::memory_order_relaxed);
+    }
+
+    _array *grow(int64_t bottom, int64_t top) const {
+      _array *bigger = new _array(2 * capacity());
+      for (int64_t i = top; i != bottom; ++i)
+        bigger->put(i, get(i));
+      return bigger;
+    }
+
+  private:
+    size_t                              _mask;
+    std::unique_ptr<std::atomic<T *>[]> _items;
+  };
+
+  // top and bottom live on their own cache lines: thieves hammer the former
+  //  while the owner keeps writing the latter.
+  alignas(64) std::atomic<int64_t> _top{0};
+  alignas(64) std::atomic<int64_t> _bottom{0};
+  std::atomic<_array *>            _buffer;
+
+  // arrays replaced by a grow() cannot be freed right away since a thief may
+  //  still be reading them. They are kept alive until the deque dies.
+  std::vector<std::unique_ptr<_array>> _arrays;
+};
+
+template <typename T>
+work_stealing_deque<T>::work_stealing_deque(size_t capacity) {
+  size_t pow2 = 1;
+  while (pow2 < capacity)
+    pow2 <<= 1;
+
+  _arrays.emplace_back(new _array(pow2));
+  _buffer.store(_arrays.back().get(), std::memory_order_relaxed);
+}
+
+template <typename T>
+void work_stealing_deque<T>::push(T *item) {
+  int64_t bottom = _bottom.load(std::memory_order_relaxed);
+  int64_t top    = _top.load(std::memory_order_acquire);
+  _array *buffer = _buffer.load(std::memory_order_relaxed);
+
+  if (bottom - top > static_cast<int64_t>(buffer->capacity()) - 1) {
+    _arrays.emplace_back(buffer->grow(bottom, top));
+    buffer = _arrays.back().get();
+    _buffer.store(buffer, std::memory_order_release);
+  }
+
+  buffer->put(bottom, item);
+  std::atomic_thread_fence(std::memory_order_release);
+  _bottom.store(bottom + 1, std::memory_order_relaxed);
+}
+
+template <typename T>
+T *work_stealing_deque<T>::pop() {
+  int64_t bottom = _bottom.load(std::memory_order_relaxed) - 1;
+  _array *buffer = _buffer.load(std::memory_order_relaxed);
+  _bottom.store(bottom, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  int64_t top = _top.load(std::memory_order_relaxed);
+
+  if (top > bottom) {
+    // empty - restore the bottom we speculatively decremented.
+    _bottom.store(bottom + 1, std::memory_order_relaxed);
+    return nullptr;
+  }
+
+  T *item = buffer->get(bottom);
+  if (top == bottom) {
+    // last item: race against thieves for it.
+    if (!_top.compare_exchange_strong(top, top + 1,
+                                      std::memory_order_seq_cst,
+                                      std::memory_order_relaxed))
+      item = nullptr;
+    _bottom.store(bottom + 1, std::memory_order_relaxed);
+  }
+  return item;
+}
+
+template <typename T>
+T *work_stealing_deque<T>::steal() {
+  int64_t top = _top.load(std::memory_order_acquire);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  int64_t bottom = _bottom.load(std::memory_order_acquire);
+
+  if (top >= bottom)
+    return nullptr;
+
+  T *item = _buffer.load(std::memory_order_acquire)->get(top);
+  if (!_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                    std::memory_order_relaxed))
+    return nullptr;
+  return item;
+}
+
+template <typename T>
+bool work_stealing_deque<T>::empty() const {
+  return size() == 0;
+}
+
+template <typename T>
+size_t work_stealing_deque<T>::size() const {
+  int64_t bottom = _bottom.load(std::memory_order_relaxed);
+  int64_t top    = _top.load(std::memory_order_relaxed);
+  return bottom > top ? static_cast<size_t>(bottom - top) : 0;
+}
@@ -1,6 +1,8 @@
 // Implementation of the thread_pool class by osuka_
 // https://codereview.stackexchange.com/questions/221626/c17-thread-pool
 
+#include <atomic>
+#include <functional>
 #include <iostream>
 #include <vector>
 #include <threadpool.h>
@@ -10,6 +12,34 @@ int multiply(int x, int y)
     return x * y;
 }
 
+// Recursive tasks wait for their subtasks through the pool, which runs
+// pending tasks meanwhile instead of blocking the worker.
+long fibonacci(thread_pool &pool, int n)
+{
+    if ( n < 2 )
+        return n;
+
+    auto first = pool.execute(fibonacci, std::ref(pool), n - 1);
+    long second = fibonacci(pool, n - 2);
+    return pool.get(first) + second;
+}
+
+// Coroutines hop onto the pool with co_await schedule(), and await each
+// other without blocking any thread.
+task<int> coroutine_multiply(thread_pool &pool, int x, int y)
+{
+    co_await pool.schedule();
+    co_return multiply(x, y);
+}
+
+task<int> coroutine_sum(thread_pool &pool)
+{
+    int total = 0;
+    for ( int i = 1; i <= 4; ++i )
+        total += co_await coroutine_multiply(pool, i, 10);
+    co_return total;
+}
+
 int main()
 {
     thread_pool                   pool   ;
@@ -25,5 +55,152 @@ int main()
         std::cout << fut.get() << std::endl;
     }
 
+    // Many tasks can be submitted under a single lock.
+    auto squares = pool.execute_batch(8, [](size_t i) { return i * i; });
+    size_t squares_sum{0};
+    for (auto &fut : squares)
+    {
+        squares_sum += fut.get();
+    }
+    std::cout << squares_sum << std::endl;
+
+    // Loops reuse the workers, the calling thread taking part as well.
+    std::vector<int> values(10000);
+    pool.parallel_for(size_t(0), values.size(), [&values](size_t i) { values[i] = int(i % 10); });
+    std::cout << pool.parallel_reduce(values.begin(), values.end(), 0,
+                                      [](auto it) { return *it; },
+                                      [](int a, int b) { return a + b; })
+              << std::endl;
+
+    // Continuations run as new tasks once their input is ready,
+    // instead of blocking a worker on get().
+    auto doubled = pool.spawn(multiply, 21, 1).then([](int x) { return x * 2; });
+    auto both    = pool.when_all(std::vector<pool_future<int>>{doubled, pool.spawn(multiply, 3, 3)});
+    std::cout << both.then([](const std::vector<pool_future<int>> &results) {
+                         return results[0].get() + results[1].get();
+                     }).get()
+              << std::endl;
+
+    std::cout << pool.get(pool.execute(fibonacci, std::ref(pool), 20)) << std::endl;
+
+    std::cout << pool.spawn(coroutine_sum(pool)).get() << std::endl;
+
+    // When the result is not needed, post() skips the promise/future pair.
+    std::atomic<int> posted{0};
+    for ( int i = 0; i < 1000; ++i )
+    {
+        pool.post([&posted] { ++posted; });
+    }
+
+    // A submit_buffer gathers tasks on the submitting thread, and hands
+    // them over to the pool a batch at a time.
+    std::atomic<int> buffered{0};
+    {
+        thread_pool::submit_buffer buffer(pool, 32);
+        for ( int i = 0; i < 100; ++i )
+        {
+            buffer.post([&buffered] { ++buffered; });
+        }
+    } // ~submit_buffer flushes what is left
+
+    // Tasks spawned from within a task go to the worker's own deque,
+    // where idle workers can steal them.
+    std::atomic<int> sum{0};
+    {
+        thread_pool stealing_pool( std::thread::hardware_concurrency(),
+                                   thread_pool::scheduling::work_stealing );
+
+        for ( int i = 0; i < 4; ++i )
+        {
+            stealing_pool.execute([&] {
+                for ( int j = 1; j <= 100; ++j )
+                    stealing_pool.execute([&sum, j] { sum += j; });
+            });
+        }
+    } // ~thread_pool drains every deque
+    std::cout << sum << std::endl;
+
+    while ( posted != 1000 ) { std::this_thread::yield(); }
+    std::cout << posted << std::endl;
+    while ( buffered != 100 ) { std::this_thread::yield(); }
+    std::cout << buffered << std::endl;
+
+    // A bounded pool throttles its producers: once 4 tasks are queued,
+    // this one runs further submissions on the submitting thread.
+    {
+        thread_pool::options bounded;
+        bounded.thread_count = 2;
+        bounded.capacity     = 4;
+        bounded.on_full      = thread_pool::overflow::caller_runs;
+        thread_pool bounded_pool(bounded);
+
+        auto doubles = bounded_pool.execute_batch(100, [](size_t i) { return multiply(int(i), 2); });
+        int doubles_sum{0};
+        for (auto &fut : doubles)
+        {
+            doubles_sum += fut.get();
+        }
+        std::cout << doubles_sum << std::endl;
+    }
+
+    // shutdown_now() cancels the tasks that have not started yet, and asks
+    // running ones to stop through the pool's stop token - which is handed
+    // to the tasks that take one.
+    {
+        thread_pool stopping_pool(1);
+        stopping_pool.post([](std::stop_token stop) {
+            while ( !stop.stop_requested() ) { std::this_thread::yield(); }
+        });
+        auto cancelled = stopping_pool.execute(multiply, 6, 7);
+        stopping_pool.shutdown_now();
+
+        try
+        {
+            cancelled.get();
+        }
+        catch ( const thread_pool::task_cancelled &e )
+        {
+            std::cout << e.what() << std::endl;
+        }
+    }
+
+    // A task may resize its own pool while shutdown() waits for it to end:
+    // from then on, resize() throws instead of starting workers.
+    {
+        thread_pool::options resizable;
+        resizable.thread_count = 1;
+        resizable.max_threads  = 2;
+        thread_pool resizing_pool(resizable);
+
+        std::atomic<bool> shutting_down{false};
+        auto resized = resizing_pool.execute([&] {
+            while ( !shutting_down ) { std::this_thread::yield(); }
+            for ( ;; )
+            {
+                resizing_pool.resize(1);
+                std::this_thread::yield();
+            }
+        });
+        shutting_down = true;
+        resizing_pool.shutdown();
+
+        try
+        {
+            resized.get();
+        }
+        catch ( const std::logic_error &e )
+        {
+            std::cout << e.what() << std::endl;
+        }
+    }
+
+#ifdef THREAD_POOL_STATS
+    // Built with -DTHREAD_POOL_STATS=ON, workers also time their tasks.
+    const auto stats = pool.statistics().total();
+    std::cout << stats.executed << " tasks, wait p99 "
+              << stats.wait_time.percentile(0.99).count() << " ns, run p99 "
+              << stats.run_time.percentile(0.99).count() << " ns" << std::endl;
+#endif
+
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,125 @@
+#include "block_pool.h"
+
+#include <mutex>   //lock_guard
+#include <utility> //pair
+
+namespace {
+constexpr size_t class_count = 4;
+constexpr size_t max_size    = size_t(64) << (class_count - 1);
+
+// number of blocks a thread keeps per size class before handing them over
+//  to the depot.
+constexpr size_t batch_size = 256;
+
+size_t class_of(size_t size) {
+  size_t index = 0;
+  while ((size_t(64) << index) < size)
+    ++index;
+  return index;
+}
+
+// a free block. The first block of a batch handed over to the depot also
+//  links the batch to the next one, and records its length: the depot is
+//  built out of the blocks it holds, so that handing a batch over - from
+//  deallocate, which must not throw - never allocates.
+struct free_node {
+  free_node *next;
+  free_node *next_batch;
+  size_t     count;
+};
+static_assert(sizeof(free_node) <= 64,
+              "a free_node must fit in a block of the smallest class");
+
+using free_list = std::pair<free_node *, size_t>;
+
+// free lists released by threads that had too many blocks - or that exited.
+struct depot {
+  std::mutex mutex;
+  free_node *batches[class_count]{};
+
+  // both expect mutex to be held.
+  void push(size_t index, free_list batch) {
+    batch.first->next_batch = batches[index];
+    batch.first->count      = batch.second;
+    batches[index]          = batch.first;
+  }
+  free_list pop(size_t index) {
+    free_node *batch = batches[index];
+    if (!batch)
+      return free_list{nullptr, 0};
+    batches[index] = batch->next_batch;
+    return free_list{batch, batch->count};
+  }
+
+  ~depot() {
+    for (size_t i = 0; i < class_count; ++i)
+      for (free_list batch = pop(i); batch.first; batch = pop(i))
+        while (free_node *block = batch.first) {
+          batch.first = block->next;
+          ::operator delete(block);
+        }
+  }
+};
+
+depot &shared_depot() {
+  static depot instance;
+  return instance;
+}
+
+// the free lists of a thread. When the thread exits, whatever it still holds
+//  goes back to the depot.
+struct cache {
+  free_list lists[class_count]{};
+
+  ~cache() {
+    depot &shared = shared_depot();
+    std::lock_guard<std::mutex> depot_lock(shared.mutex);
+    for (size_t i = 0; i < class_count; ++i)
+      if (lists[i].first)
+        shared.push(i, lists[i]);
+  }
+};
+
+thread_local cache local;
+} // namespace
+
+void *block_pool::allocate(size_t size) {
+  if (size > max_size)
+    return ::operator new(size);
+
+  size_t     index = class_of(size);
+  free_list &list  = local.lists[index];
+
+  if (!list.first) {
+    depot &shared = shared_depot();
+    std::lock_guard<std::mutex> depot_lock(shared.mutex);
+    list = shared.pop(index);
+  }
+
+  if (free_node *block = list.first) {
+    list.first = block->next;
+    --list.second;
+    return block;
+  }
+
+  return ::operator new(size_t(64) << index);
+}
+
+void block_pool::deallocate(void *block, size_t size) noexcept {
+  if (size > max_size) {
+    ::operator delete(block);
+    return;
+  }
+
+  free_list &list = local.lists[class_of(size)];
+
+  if (list.second == batch_size) {
+    depot &shared = shared_depot();
+    std::lock_guard<std::mutex> depot_lock(shared.mutex);
+    shared.push(class_of(size), list);
+    list = free_list{nullptr, 0};
+  }
+
+  list.first = new (block) free_node{list.first, nullptr, 0};
+  ++list.second;
+}
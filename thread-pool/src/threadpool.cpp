@@ -1,47 +1,892 @@
 #include "threadpool.h"
 
-thread_pool::thread_pool(size_t thread_count) {
-  for (size_t i = 0; i < thread_count; ++i) {
-    // start waiting threads. Workers listen for changes through
-    //  the thread_pool member condition_variable
-    _threads.emplace_back(std::thread([&]() {
-      std::unique_lock<std::mutex> queue_lock(_task_mutex, std::defer_lock);
+#include <fstream>   //ifstream
+#include <sstream>   //istringstream
+#include <stdexcept> //out_of_range, logic_error
+#include <string>    //string, getline, to_string
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> //_mm_pause
+#endif
+
+#ifdef __linux__
+#include <pthread.h> //pthread_setaffinity_np
+#include <sched.h>   //sched_getcpu, cpu_set_t
+#endif
+
+namespace {
+// the pool - and the index of the worker within it - that the calling thread
+//  belongs to, if any. This is how execute() knows that it is called from a
+//  task, and which deque it should push to.
+thread_local const thread_pool *current_pool   = nullptr;
+thread_local size_t             current_worker = 0;
+
+// how many tasks the calling thread is running on top of each other because
+//  it helped while waiting. Beyond max_help_depth it stops helping, rather
+//  than overflowing its stack.
+thread_local size_t help_depth     = 0;
+constexpr size_t    max_help_depth = 256;
+
+// tells the cpu that we are busy-waiting: on x86 this lowers the power drawn
+//  by the loop and frees resources for the sibling hyper-thread.
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+  asm volatile("yield");
+#endif
+}
+
+// parses a sysfs cpu list, such as "0-3,8,10-11".
+std::vector<int> parse_cpu_list(const std::string &list) {
+  std::vector<int>   cpus;
+  std::istringstream ranges(list);
+  std::string        range;
+
+  while (std::getline(ranges, range, ',')) {
+    size_t dash  = range.find('-');
+    int    first = std::stoi(range.substr(0, dash));
+    int    last  = dash == std::string::npos ? first
+                                             : std::stoi(range.substr(dash + 1));
+    for (int cpu = first; cpu <= last; ++cpu)
+      cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
+// the cpus of every NUMA node. A system that does not expose its topology is
+//  seen as a single node holding every cpu.
+std::vector<std::vector<int>> numa_nodes() {
+  std::vector<std::vector<int>> nodes;
+
+#ifdef __linux__
+  for (size_t node = 0;; ++node) {
+    std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) +
+                       "/cpulist");
+    std::string   list;
+    if (!std::getline(file, list))
+      break;
+    nodes.push_back(parse_cpu_list(list));
+  }
+#endif
+
+  if (nodes.empty()) {
+    nodes.emplace_back();
+    for (unsigned cpu = 0; cpu < std::thread::hardware_concurrency(); ++cpu)
+      nodes.back().push_back(static_cast<int>(cpu));
+  }
+  return nodes;
+}
+
+void pin_current_thread(const std::vector<int> &cpus) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus)
+    if (cpu >= 0 && cpu < CPU_SETSIZE)
+      CPU_SET(cpu, &set);
+
+  // best effort: a failure leaves the thread where the scheduler wants it.
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+  (void)cpus;
+#endif
+}
+
+int current_cpu() {
+#ifdef __linux__
+  return sched_getcpu();
+#else
+  return -1;
+#endif
+}
+} // namespace
+
+thread_pool::thread_pool(size_t thread_count, scheduling policy)
+    : thread_pool([&]() {
+        options opts;
+        opts.thread_count = thread_count;
+        opts.policy       = policy;
+        return opts;
+      }()) {}
+
+thread_pool::thread_pool(const options &opts)
+    : _policy(opts.policy), _idle(opts.idle),
+      _starvation_limit(opts.starvation_limit),
+      _min_threads(opts.thread_count), _elastic(opts.elastic),
+      _stall_timeout(opts.stall_timeout), _idle_timeout(opts.idle_timeout),
+      _capacity(opts.capacity), _on_full(opts.on_full),
+      _batch_size(std::max<size_t>(1, opts.batch_size)) {
+  std::vector<std::vector<int>> nodes(1);
+  if (opts.numa_aware)
+    nodes = numa_nodes();
+
+  // nodes made only of memory get a queue too - so that node numbers match
+  //  the system's - but no worker of their own.
+  std::vector<size_t> cpu_nodes;
+  for (size_t node = 0; node < nodes.size(); ++node) {
+    _queues.emplace_back(new _node_queue);
+    if (!nodes[node].empty())
+      cpu_nodes.push_back(node);
+
+    for (int cpu : nodes[node]) {
+      if (static_cast<size_t>(cpu) >= _cpu_nodes.size())
+        _cpu_nodes.resize(cpu + 1, 0);
+      _cpu_nodes[cpu] = node;
+    }
+  }
 
-      while (true) {
-        queue_lock.lock();
-        _task_cv.wait(queue_lock, [&]() -> bool {
-          return !_tasks.empty() || _stop_threads;
+  // every worker is created before any thread starts, so that thieves can
+  //  walk _workers without any synchronization.
+  const size_t capacity = std::max(opts.thread_count, opts.max_threads);
+  for (size_t i = 0; i < capacity; ++i) {
+    _workers.emplace_back(new _worker);
+    _worker &worker = *_workers.back();
+    worker.batch.resize(_batch_size - 1);
+
+    if (!opts.cpus.empty()) {
+      worker.cpus = {opts.cpus[i % opts.cpus.size()]};
+      worker.node = _node_of(worker.cpus.front());
+    } else if (opts.numa_aware && !cpu_nodes.empty()) {
+      worker.node = cpu_nodes[i % cpu_nodes.size()];
+      worker.cpus = nodes[worker.node];
+    }
+  }
+
+  for (size_t i = 0; i < _workers.size(); ++i) {
+    for (size_t j = 1; j < _workers.size(); ++j)
+      _workers[i]->victims.push_back((i + j) % _workers.size());
+
+    std::stable_partition(
+        _workers[i]->victims.begin(), _workers[i]->victims.end(),
+        [&](size_t victim) {
+          return _workers[victim]->node == _workers[i]->node;
         });
+  }
 
-        // used by dtor to stop all threads without having to
-        //  unceremoniously stop tasks. The tasks must all be
-        //  finished, lest we break a promise and risk a `future`
-        //  object throwing an exception.
-        if (_stop_threads && _tasks.empty())
-          return;
-
-        // to initialize temp_task, we must move the unique_ptr
-        //  from the queue to the local stack. Since a unique_ptr
-        //  cannot be copied (obviously), it must be explicitly
-        //  moved. This transfers ownership of the pointed-to
-        //  object to *this, as specified in 20.11.1.2.1
-        //  [unique.ptr.single.ctor].
-        auto temp_task = std::move(_tasks.front());
-
-        _tasks.pop();
-        queue_lock.unlock();
-
-        (*temp_task)();
-      }
-    }));
+  if (opts.thread_count != 0) {
+    std::lock_guard<std::mutex> resize_lock(_resize_mutex);
+    _resize(opts.thread_count);
   }
+
+  if (_elastic)
+    _supervisor = std::thread([this]() { _supervise(); });
 }
 
 thread_pool::~thread_pool() {
-  _stop_threads = true;
+  _stop();
+}
+
+thread_pool::submit_buffer::submit_buffer(thread_pool &pool, size_t capacity)
+    : _pool(pool), _capacity(std::max<size_t>(1, capacity)) {
+  _tasks.reserve(_capacity);
+}
+
+thread_pool::submit_buffer::~submit_buffer() {
+  try {
+    flush();
+  } catch (const queue_full &) {
+  }
+}
+
+void thread_pool::submit_buffer::flush() {
+  // whatever happens, the buffer ends up empty: tasks the pool refused are
+  //  not retried.
+  try {
+    _pool._enqueue_all(_tasks.data(), _tasks.size());
+  } catch (...) {
+    _tasks.clear();
+    throw;
+  }
+  _tasks.clear();
+}
+
+void thread_pool::submit_buffer::_add(_task_ptr task) {
+  _tasks.push_back(std::move(task));
+  if (_tasks.size() == _capacity)
+    flush();
+}
+
+void thread_pool::shutdown() {
+  if (_on_worker())
+    throw std::logic_error("thread_pool::shutdown: called from a task");
+
+  _stop();
+}
+
+void thread_pool::shutdown_now() {
+  if (_on_worker())
+    throw std::logic_error("thread_pool::shutdown_now: called from a task");
+
+  // workers cancel whatever they take from now on - we help them clear the
+  //  queues.
+  _cancelling.store(true);
+  _stop_source.request_stop();
+  _cancel_pending();
+  _stop();
+}
+
+void thread_pool::_stop() {
+  {
+    std::lock_guard<std::mutex> sleep_lock(_task_mutex);
+    _stop_threads.store(true);
+  }
   _task_cv.notify_all();
+  _room_cv.notify_all();
+  _supervisor_cv.notify_all();
+
+  // workers only exit once no task is pending: with a draining shutdown,
+  //  this is where the remaining tasks run.
+  std::call_once(_joined, [this]() {
+    // the supervisor goes first: it may still be starting workers. Then,
+    //  taking _resize_mutex waits for a resize() in progress: any later one
+    //  sees _stop_threads and throws. The lock is not held while joining - a
+    //  task calling resize() would otherwise deadlock the shutdown.
+    if (_supervisor.joinable())
+      _supervisor.join();
 
-  for (std::thread &thread : _threads) {
-    thread.join();
+    { std::lock_guard<std::mutex> resize_lock(_resize_mutex); }
+    for (auto &worker : _workers) {
+      if (worker->thread.joinable())
+        worker->thread.join();
+    }
+  });
+
+  // with no worker left, tasks submitted from now on - or in a race with the
+  //  last workers exiting - can only be cancelled.
+  _cancelling.store(true);
+  _cancel_pending();
+}
+
+void thread_pool::_cancel_pending() {
+  while (_task_ptr task = _take_task(_workers.size()))
+    task->cancel();
+}
+
+size_t thread_pool::thread_count() const {
+  return _thread_target.load();
+}
+
+void thread_pool::resize(size_t thread_count) {
+  if (thread_count == 0 || thread_count > _workers.size())
+    throw std::out_of_range("thread_pool::resize: invalid thread count");
+
+  std::lock_guard<std::mutex> resize_lock(_resize_mutex);
+  if (_stop_threads.load())
+    throw std::logic_error("thread_pool::resize: the pool is shut down");
+
+  _resize(thread_count);
+}
+
+void thread_pool::_resize(size_t thread_count) {
+  std::vector<size_t> starting;
+  {
+    std::lock_guard<std::mutex> sleep_lock(_task_mutex);
+    _thread_target.store(thread_count);
+
+    // a worker still running above the former target - on its way out - is
+    //  kept: it checks the target under this lock before leaving.
+    for (size_t i = 0; i < thread_count; ++i) {
+      if (!_workers[i]->running) {
+        _workers[i]->running = true;
+        starting.push_back(i);
+      }
+    }
+  }
+
+  // parked workers above the new target must wake up to retire.
+  _task_cv.notify_all();
+
+  for (size_t i : starting) {
+    // the slot may still hold a retired thread: it has left its loop, but
+    //  must be joined before another thread owns the deque.
+    if (_workers[i]->thread.joinable())
+      _workers[i]->thread.join();
+
+    // start waiting threads. Workers listen for changes through
+    //  the thread_pool member condition_variable
+    _workers[i]->thread = std::thread([this, i]() { _run_worker(i); });
+  }
+
+  if (thread_count > _started.load())
+    _started.store(thread_count);
+}
+
+void thread_pool::_enqueue(_task_ptr task) {
+  _enqueue_all(&task, 1, _target());
+}
+
+void thread_pool::_enqueue(_task_ptr task, const _target &target) {
+  _enqueue_all(&task, 1, target);
+}
+
+void thread_pool::_enqueue_all(_task_ptr *tasks, size_t count) {
+  _enqueue_all(tasks, count, _target());
+}
+
+void thread_pool::_enqueue_all(_task_ptr *tasks, size_t count,
+                               const _target &target) {
+  while (count != 0) {
+    if (const size_t reserved = _reserve(count)) {
+      _publish(tasks, reserved, target);
+      tasks += reserved;
+      count -= reserved;
+      continue;
+    }
+
+    const overflow policy = _on_worker() ? overflow::caller_runs : _on_full;
+
+    switch (policy) {
+    case overflow::block:
+      _wait_for_room();
+      break;
+
+    case overflow::fail:
+      throw queue_full();
+
+    case overflow::caller_runs:
+      // like a task run while helping, it interrupts the one below it.
+      ++help_depth;
+      _run_task(*tasks[0], _on_worker() ? current_worker : _workers.size());
+      --help_depth;
+      tasks[0].reset();
+      ++tasks;
+      --count;
+      break;
+
+    case overflow::drop_oldest:
+      // nothing to drop means that the tasks filling the pool are being
+      //  published by other threads: they will be there in a moment.
+      if (_task_ptr oldest = _take_task(_workers.size()))
+        oldest->cancel();
+      else
+        std::this_thread::yield();
+      break;
+    }
+  }
+}
+
+size_t thread_pool::_reserve(size_t count) {
+  // counting the tasks before they are visible ensures that _pending never
+  //  drops below the number of queued tasks - a worker seeing it non-zero
+  //  may just have to look again. The increment must also happen before
+  //  _sleeping is read, while a worker going to sleep does the opposite: at
+  //  least one of the two sees the other.
+  // a stopping pool takes everything: its tasks are about to run or to be
+  //  cancelled anyway, and nobody should block on it.
+  if (_capacity == 0 || _stop_threads.load(std::memory_order_relaxed)) {
+    _pending.fetch_add(count);
+    return count;
   }
+
+  size_t pending = _pending.load();
+  size_t reserved;
+  do {
+    if (pending >= _capacity)
+      return 0;
+    reserved = std::min(count, _capacity - pending);
+  } while (!_pending.compare_exchange_weak(pending, pending + reserved));
+
+  return reserved;
+}
+
+void thread_pool::_wait_for_room() {
+  std::unique_lock<std::mutex> sleep_lock(_task_mutex);
+  _blocked.fetch_add(1);
+  _room_cv.wait(sleep_lock, [&]() -> bool {
+    return _pending.load() < _capacity || _stop_threads.load();
+  });
+  _blocked.fetch_sub(1);
+}
+
+void thread_pool::_publish(_task_ptr *tasks, size_t count,
+                           const _target &target) {
+#ifdef THREAD_POOL_STATS
+  const auto now = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < count; ++i)
+    tasks[i]->enqueued = now;
+#endif
+
+  // only plain tasks may go to a deque: it has no notion of priority.
+  const bool plain = target.node == _any_node &&
+                     target.level == _target{}.level;
+
+  if (plain && _policy == scheduling::work_stealing && current_pool == this) {
+    for (size_t i = 0; i < count; ++i)
+      _workers[current_worker]->tasks.push(tasks[i].release());
+  } else {
+    _node_queue &queue =
+        *_queues[target.node == _any_node ? _home_node() : target.node];
+    std::lock_guard<std::mutex> queue_lock(queue.mutex);
+    for (size_t i = 0; i < count; ++i)
+      queue.push(std::move(tasks[i]), target);
+  }
+
+  // taking the lock before notifying ensures that a worker which has just
+  //  checked its predicate is actually waiting.
+  if (_sleeping.load() != 0) {
+    { std::lock_guard<std::mutex> sleep_lock(_task_mutex); }
+    _wake(count);
+  }
+
+  // checked after pushing: either the shutting down thread finds our tasks
+  //  when it clears the queues, or we see the flag and clear them ourselves.
+  if (_cancelling.load())
+    _cancel_pending();
+}
+
+size_t thread_pool::_node_of(int cpu) const {
+  if (cpu < 0 || static_cast<size_t>(cpu) >= _cpu_nodes.size())
+    return 0;
+  return _cpu_nodes[cpu];
+}
+
+size_t thread_pool::_home_node() const {
+  if (current_pool == this)
+    return _workers[current_worker]->node;
+  if (_queues.size() == 1)
+    return 0;
+  return _node_of(current_cpu());
+}
+
+void thread_pool::_wake(size_t count) {
+  // there is no point in waking up more workers than there are new tasks.
+  if (count >= _sleeping.load()) {
+    _task_cv.notify_all();
+    return;
+  }
+
+  for (size_t i = 0; i < count; ++i)
+    _task_cv.notify_one();
+}
+
+thread_pool::_task_ptr thread_pool::_take_task(size_t index, bool newest) {
+  _task_container_base *task = nullptr;
+
+  // an index past the last worker stands for a thread outside of the pool:
+  //  it has no deque of its own, and may steal from every worker.
+  const bool is_worker = index < _workers.size();
+
+  // in fifo mode, a deque only ever holds the rest of a batch.
+  const bool deques = _policy == scheduling::work_stealing || _batch_size > 1;
+
+  // a task of our deque waits while a more urgent one is queued: the deque
+  //  may hold a batch taken before that one was submitted.
+  bool deferred = false;
+  if (is_worker && deques && !_workers[index]->tasks.empty() &&
+      (task = _workers[index]->tasks.pop())) {
+    for (const auto &queue : _queues) {
+      if (queue->has_urgent(task->level)) {
+        _workers[index]->tasks.push(task);
+        task     = nullptr;
+        deferred = true;
+        break;
+      }
+    }
+  }
+
+  // our node's queue first, then the other nodes' ones.
+  const size_t home = is_worker ? _workers[index]->node : _home_node();
+  for (size_t i = 0; i < _queues.size() && !task; ++i) {
+    _node_queue &queue = *_queues[(home + i) % _queues.size()];
+    if (queue.size.load(std::memory_order_relaxed) == 0)
+      continue;
+
+    // since a unique_ptr cannot be copied (obviously), the one in the
+    //  queue is released, and ownership of the pointed-to object comes
+    //  back to the _task_ptr returned below - like for deque items.
+    size_t batched = 0;
+    {
+      std::lock_guard<std::mutex> queue_lock(queue.mutex);
+      task = queue.pop(_starvation_limit, newest).release();
+
+      if (task && is_worker && !newest && _batch_size > 1) {
+        const size_t share =
+            queue.size.load(std::memory_order_relaxed) /
+            std::max<size_t>(1, _thread_target.load(std::memory_order_relaxed));
+        batched = queue.pop_batch(_workers[index]->batch.data(),
+                                  std::min(share, _batch_size - 1),
+                                  _starvation_limit);
+      }
+    }
+
+    // the extra tasks stay counted in _pending. Pushed newest first, they
+    //  are popped back in submission order.
+    while (batched != 0) {
+      _worker &worker = *_workers[index];
+      worker.tasks.push(worker.batch[--batched].release());
+    }
+  }
+
+  // someone else took the more urgent task in the meantime.
+  if (!task && deferred)
+    task = _workers[index]->tasks.pop();
+
+  if (!task && deques) {
+    // victims are visited starting from our right neighbour, so that idle
+    //  workers spread over the deques instead of all hammering the first
+    //  one - and those of our node first, so that tasks stay where their
+    //  data is.
+    // slots past _started never ran a thread: their deques are empty.
+    const size_t started = _started.load(std::memory_order_relaxed);
+    if (is_worker) {
+      for (size_t victim : _workers[index]->victims)
+        if (victim < started && (task = _workers[victim]->tasks.steal()))
+          break;
+#ifdef THREAD_POOL_STATS
+      if (task)
+        _counters::bump(_workers[index]->counters.steals);
+#endif
+    } else {
+      for (size_t i = 0; i < started && !task; ++i)
+        task = _workers[i]->tasks.steal();
+    }
+  }
+
+  if (task) {
+    _pending.fetch_sub(1);
+
+    // same handshake as with _sleeping, for the submitters waiting for room.
+    if (_blocked.load() != 0) {
+      { std::lock_guard<std::mutex> sleep_lock(_task_mutex); }
+      _room_cv.notify_one();
+    }
+
+    if (_elastic)
+      _taken.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  return _task_ptr(task);
+}
+
+thread_pool::idle_stats thread_pool::idle_statistics() const {
+  idle_stats stats;
+  for (const auto &worker : _workers) {
+    stats.spin_hits  += worker->spin_hits.load(std::memory_order_relaxed);
+    stats.yield_hits += worker->yield_hits.load(std::memory_order_relaxed);
+    stats.parks      += worker->parks.load(std::memory_order_relaxed);
+  }
+  return stats;
+}
+
+#ifdef THREAD_POOL_STATS
+thread_pool::worker_stats &
+thread_pool::worker_stats::operator+=(const worker_stats &other) {
+  executed  += other.executed;
+  steals    += other.steals;
+  idle_time += other.idle_time;
+  wait_time += other.wait_time;
+  run_time  += other.run_time;
+  return *this;
+}
+
+thread_pool::worker_stats thread_pool::pool_stats::total() const {
+  worker_stats sum;
+  for (const worker_stats &worker : workers)
+    sum += worker;
+  return sum;
+}
+
+thread_pool::pool_stats thread_pool::statistics() const {
+  pool_stats stats;
+  stats.queued = _pending.load(std::memory_order_relaxed);
+
+  const size_t started = _started.load();
+  stats.workers.resize(started);
+  for (size_t i = 0; i < started; ++i) {
+    const _counters &counters = _workers[i]->counters;
+    worker_stats    &worker   = stats.workers[i];
+
+    worker.executed  = counters.executed.load(std::memory_order_relaxed);
+    worker.steals    = counters.steals.load(std::memory_order_relaxed);
+    worker.idle_time = std::chrono::nanoseconds(
+        counters.idle_ns.load(std::memory_order_relaxed));
+    for (size_t b = 0; b < latency_histogram::bucket_count; ++b) {
+      const auto waits = counters.wait_time[b].load(std::memory_order_relaxed);
+      const auto runs  = counters.run_time[b].load(std::memory_order_relaxed);
+      worker.wait_time.add(b, waits);
+      worker.run_time.add(b, runs);
+    }
+  }
+  return stats;
+}
+#endif
+
+size_t thread_pool::node_count() const {
+  return _queues.size();
+}
+
+bool thread_pool::_run_pending_task() {
+  if (help_depth == max_help_depth)
+    return false;
+
+  // a waiting thread takes the newest task of the shared queues, not the
+  //  oldest one: that is most likely the awaited task or one of its
+  //  subtasks - like a worker popping its own deque. The oldest one is
+  //  usually unrelated and large, and may wait in turn, nesting waits deeper
+  //  and deeper.
+  _task_ptr task = _take_task(
+      current_pool == this ? current_worker : _workers.size(), true);
+  if (!task)
+    return false;
+
+  ++help_depth;
+  _run_task(*task, current_pool == this ? current_worker : _workers.size());
+  --help_depth;
+  return true;
+}
+
+void thread_pool::_run_task(_task_container_base &task, size_t index) {
+  if (_cancelling.load(std::memory_order_relaxed)) {
+    task.cancel();
+    return;
+  }
+
+#ifdef THREAD_POOL_STATS
+  if (index >= _workers.size()) {
+    task();
+    return;
+  }
+
+  _counters &counters = _workers[index]->counters;
+  const auto start    = std::chrono::steady_clock::now();
+
+  // a task run while helping interrupts the one below it: the worker is
+  //  busy, not idle, in between.
+  if (help_depth == 0)
+    _counters::bump(counters.idle_ns,
+                    uint64_t((start - counters.idle_since).count()));
+  _counters::bump(counters.wait_time[latency_histogram::bucket_of(
+      start - task.enqueued)]);
+
+  task();
+
+  const auto end = std::chrono::steady_clock::now();
+  _counters::bump(counters.run_time[latency_histogram::bucket_of(end - start)]);
+  _counters::bump(counters.executed);
+  if (help_depth == 0)
+    counters.idle_since = end;
+#else
+  (void)index;
+  task();
+#endif
+}
+
+bool thread_pool::_on_worker() const {
+  return current_pool == this;
+}
+
+void thread_pool::_run_worker(size_t index) {
+  current_pool   = this;
+  current_worker = index;
+
+  _worker &worker = *_workers[index];
+  if (!worker.cpus.empty())
+    pin_current_thread(worker.cpus);
+
+#ifdef THREAD_POOL_STATS
+  worker.counters.idle_since = std::chrono::steady_clock::now();
+#endif
+
+  while (true) {
+    if (index >= _thread_target.load(std::memory_order_relaxed) &&
+        _retire(index))
+      return;
+
+    if (_task_ptr task = _take_task(index)) {
+      _run_task(*task, index);
+      continue;
+    }
+
+    if (_wait_for_work(worker))
+      continue;
+
+    std::unique_lock<std::mutex> sleep_lock(_task_mutex);
+    worker.parks.fetch_add(1, std::memory_order_relaxed);
+    _sleeping.fetch_add(1);
+
+    auto ready = [&]() -> bool {
+      return _pending.load() != 0 || _stop_threads ||
+             index >= _thread_target.load();
+    };
+    bool woken = true;
+    if (_elastic)
+      woken = _task_cv.wait_for(sleep_lock, _idle_timeout, ready);
+    else
+      _task_cv.wait(sleep_lock, ready);
+
+    _sleeping.fetch_sub(1);
+
+    // used by dtor to stop all threads without having to
+    //  unceremoniously stop tasks. The tasks must all be
+    //  finished, lest we break a promise and risk a `future`
+    //  object throwing an exception.
+    if (_stop_threads && _pending.load() == 0) {
+      worker.running = false;
+      return;
+    }
+
+    // in elastic mode, the last worker above the minimum retires once it
+    //  has been idle for long enough. Retiring the last one only keeps the
+    //  running workers contiguous.
+    if (!woken && index + 1 == _thread_target.load() && index >= _min_threads)
+      _thread_target.store(index);
+  }
+}
+
+bool thread_pool::_retire(size_t index) {
+  _worker &worker = *_workers[index];
+
+  // whatever is left in our deque goes to the shared queue of our node,
+  //  where any worker can get it. It is still accounted for in _pending.
+  //  Batched tasks go back to the level they were taken from.
+  if (_task_container_base *task = worker.tasks.pop()) {
+    _node_queue &queue = *_queues[worker.node];
+    std::lock_guard<std::mutex> queue_lock(queue.mutex);
+    do {
+      _target target;
+      target.level = task->level;
+      queue.push(_task_ptr(task), target);
+    } while ((task = worker.tasks.pop()));
+  }
+
+  std::lock_guard<std::mutex> sleep_lock(_task_mutex);
+  if (index < _thread_target.load())
+    return false; // resized up in the meantime: keep going.
+
+  worker.running = false;
+  return true;
+}
+
+void thread_pool::_supervise() {
+  size_t last_taken = _taken.load(std::memory_order_relaxed);
+
+  std::unique_lock<std::mutex> sleep_lock(_task_mutex);
+  while (!_supervisor_cv.wait_for(sleep_lock, _stall_timeout,
+                                  [&]() -> bool { return _stop_threads; })) {
+    const size_t taken   = _taken.load(std::memory_order_relaxed);
+    const bool   stalled = taken == last_taken && _pending.load() != 0;
+    last_taken = taken;
+
+    const size_t target = _thread_target.load();
+    if (!stalled || target == _workers.size())
+      continue;
+
+    sleep_lock.unlock();
+    {
+      std::lock_guard<std::mutex> resize_lock(_resize_mutex);
+      _resize(target + 1);
+    }
+    sleep_lock.lock();
+  }
+}
+
+bool thread_pool::_wait_for_work(_worker &worker) const {
+  // polling _pending - rather than the queues themselves - keeps the loop
+  //  off the queue mutex and the deques' cache lines until there is work.
+  for (size_t i = 0; i < _idle.spin_count; ++i) {
+    if (_pending.load(std::memory_order_relaxed) != 0) {
+      worker.spin_hits.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+    cpu_relax();
+  }
+
+  for (size_t i = 0; i < _idle.yield_count; ++i) {
+    if (_pending.load(std::memory_order_relaxed) != 0) {
+      worker.yield_hits.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+    std::this_thread::yield();
+  }
+
+  return false;
+}
+
+void thread_pool::_node_queue::push(_task_ptr task, const _target &target) {
+  task->level = target.level;
+  _counts[target.level].fetch_add(1, std::memory_order_relaxed);
+  if (target.level == 0) {
+    _deadlines.push_back({target.deadline, _sequence++, std::move(task)});
+    std::push_heap(_deadlines.begin(), _deadlines.end());
+  } else {
+    _fifos[target.level - 1].push(std::move(task));
+  }
+  size.fetch_add(1, std::memory_order_relaxed);
+}
+
+thread_pool::_task_ptr thread_pool::_node_queue::pop(size_t starvation_limit,
+                                                    bool   newest) {
+  // serve the most urgent non-empty level - unless a less urgent one has
+  //  been passed over starvation_limit times already.
+  size_t served      = _levels;
+  size_t most_urgent = _levels;
+  for (size_t level = 0; level < _levels; ++level) {
+    if (_empty(level))
+      continue;
+
+    if (served == _levels) {
+      served = most_urgent = level;
+    } else if (starvation_limit != 0 && ++_skipped[level] >= starvation_limit) {
+      served = level;
+      break;
+    }
+  }
+
+  if (served == _levels)
+    return nullptr;
+
+  _skipped[served] = 0;
+
+  // a level served for its age rather than its urgency gets a single task.
+  _served    = served;
+  _batchable = served != 0 && served == most_urgent;
+  _counts[served].fetch_sub(1, std::memory_order_relaxed);
+  size.fetch_sub(1, std::memory_order_relaxed);
+
+  if (served != 0)
+    return newest ? _fifos[served - 1].pop_back() : _fifos[served - 1].pop();
+
+  std::pop_heap(_deadlines.begin(), _deadlines.end());
+  _task_ptr task = std::move(_deadlines.back().task);
+  _deadlines.pop_back();
+  return task;
+}
+
+size_t thread_pool::_node_queue::pop_batch(_task_ptr *tasks, size_t count,
+                                           size_t starvation_limit) {
+  if (!_batchable)
+    return 0;
+
+  ring_buffer<_task_ptr> &fifo = _fifos[_served - 1];
+  count = std::min(count, fifo.size());
+
+  // each task of the batch passes over the less urgent levels, as if it had
+  //  been popped on its own: the batch stops short of starving them.
+  for (size_t level = _served + 1; level < _levels && starvation_limit != 0;
+       ++level)
+    if (!_empty(level))
+      count = std::min(count, starvation_limit - 1 - _skipped[level]);
+
+  for (size_t level = _served + 1; level < _levels; ++level)
+    if (!_empty(level))
+      _skipped[level] += count;
+
+  for (size_t i = 0; i < count; ++i)
+    tasks[i] = fifo.pop();
+
+  _counts[_served].fetch_sub(count, std::memory_order_relaxed);
+  size.fetch_sub(count, std::memory_order_relaxed);
+  return count;
+}
+
+bool thread_pool::_node_queue::has_urgent(size_t level) const {
+  for (size_t more_urgent = 0; more_urgent < level; ++more_urgent)
+    if (_counts[more_urgent].load(std::memory_order_relaxed) != 0)
+      return true;
+  return false;
+}
+
+bool thread_pool::_node_queue::_empty(size_t level) const {
+  return level == 0 ? _deadlines.empty() : _fifos[level - 1].empty();
 }
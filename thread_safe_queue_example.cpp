@@ -3,169 +3,1866 @@
  ************************************************************/
 
 #include <iostream>
-#include <list>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 #include <map>
 #include <optional>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <functional>
 #include <variant>
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+/*!
+ * @brief queueThreadSafe
+ *        push() and pop() operations can only be performed if 
+ *        the queue state is OPENED.
+ *        These operations also have a settable timeout and will
+ *        give an indication of success/failure:
+ *              - through a bool for push()
+ *              - through std::optional for pop()
+ */
+
+/*!
+ * @note We will make use of some C++17 features
+ *       such as std::variant for error-handling.
+ * 
+ * You can find more informations about std::variant
+ * here https://en.cppreference.com/w/cpp/utility/variant
+ * and some tests on it here 
+ * https://github.com/MericLuc/Cpp17-Features-tests/std-variant
+ */
+
+/*!
+ * @brief queueBackend
+ *        Storage of a queueThreadSafe:
+ *              - LOCKED : a segmentedBuffer, guarded by the queue
+ *                         mutex.
+ *              - MPMC   : a lock-free ring buffer (mpmcRing), that
+ *                         any number of producers and consumers
+ *                         use without taking the mutex unless
+ *                         they have to wait.
+ *              - SPSC   : a wait-free ring buffer (spscRing), for
+ *                         queues with exactly one producer thread
+ *                         and one consumer thread.
+ */
+enum class queueBackend { LOCKED, MPMC, SPSC };
+
+/*!
+ * @brief segmentedBuffer
+ *        FIFO storage of the LOCKED backend: elements live in
+ *        fixed-size chunks, chained from head to tail, so that
+ *        pushing and popping walk contiguous memory.
+ *        A chunk that pop_front() is done with is kept aside and
+ *        reused by the next chunk push needs: once the buffer has
+ *        grown to its working size - bounded by the capacity of
+ *        the queue - it no longer allocates.
+ *        Not thread-safe: queueThreadSafe guards it with its mutex.
+ */
+template <typename T>
+class segmentedBuffer
+{
+public:
+    segmentedBuffer() = default;
+    ~segmentedBuffer()
+    {
+        clear();
+        release(m_head);
+        release(m_spare);
+    }
+
+    segmentedBuffer(const segmentedBuffer&) = delete;
+    segmentedBuffer& operator=(const segmentedBuffer&) = delete;
+
+    template <typename... Args>
+    T& emplace_back(Args&&... p_args)
+    {
+        if ( m_tail == nullptr || m_tailPos == CHUNK_SIZE )
+            grow();
+
+        T* l_elm = ::new (m_tail->slot(m_tailPos)) T(std::forward<Args>(p_args)...);
+        ++m_tailPos;
+        ++m_size;
+        return *l_elm;
+    }
+
+    T& front() { return *std::launder(m_head->slot(m_headPos)); }
+
+    void pop_front()
+    {
+        front().~T();
+
+        // Empty again: start over at the beginning of the same chunk
+        if ( --m_size == 0 )
+        {
+            m_headPos = m_tailPos = 0;
+            return;
+        }
+
+        if ( ++m_headPos == CHUNK_SIZE )
+        {
+            Chunk* l_used = m_head;
+            m_head        = m_head->m_next;
+            m_headPos     = 0;
+
+            l_used->m_next = m_spare;
+            m_spare        = l_used;
+        }
+    }
+
+    void clear() { while ( m_size != 0 ) pop_front(); }
+
+    bool   empty() const { return m_size == 0; }
+    size_t size()  const { return m_size;      }
+
+private:
+    static constexpr size_t CHUNK_SIZE = std::max<size_t>(16, 4096 / sizeof(T));
+
+    struct Chunk
+    {
+        Chunk*                   m_next{nullptr};
+        alignas(T) unsigned char m_storage[CHUNK_SIZE * sizeof(T)];
+
+        T* slot(size_t p_pos) { return reinterpret_cast<T*>(m_storage + p_pos * sizeof(T)); }
+    };
+
+    void grow()
+    {
+        Chunk* l_chunk = m_spare;
+        if ( l_chunk != nullptr )
+            m_spare = l_chunk->m_next;
+        else
+            l_chunk = new Chunk;
+        l_chunk->m_next = nullptr;
+
+        if ( m_tail != nullptr )
+            m_tail->m_next = l_chunk;
+        else
+            m_head = l_chunk;
+
+        m_tail    = l_chunk;
+        m_tailPos = 0;
+    }
+
+    static void release(Chunk* p_chunk)
+    {
+        while ( p_chunk != nullptr )
+            delete std::exchange(p_chunk, p_chunk->m_next);
+    }
+
+    Chunk* m_head   {nullptr}; /*!< Chunk of the oldest element            */
+    Chunk* m_tail   {nullptr}; /*!< Chunk of the newest element            */
+    Chunk* m_spare  {nullptr}; /*!< Chunks kept for reuse                  */
+    size_t m_headPos{0};       /*!< Slot of the oldest element in m_head   */
+    size_t m_tailPos{0};       /*!< Slot after the newest element in m_tail */
+    size_t m_size   {0};       /*!< Number of elements                     */
+};
+
+/*!
+ * @brief mpmcRing
+ *        Bounded lock-free multi-producer/multi-consumer ring
+ *        buffer, after Dmitry Vyukov's design.
+ *        Every cell carries a sequence number, which tells who
+ *        may use it next:
+ *              - the push at position p when it equals p
+ *              - the pop  at position p when it equals p + 1
+ *        Producers claim a position with a CAS on m_tail, and
+ *        consumers with a CAS on m_head: a producer and a
+ *        consumer only ever meet on the cell they hand over.
+ */
+template <typename T>
+class mpmcRing
+{
+    static_assert(std::is_nothrow_move_constructible_v<T>, "a claimed cell must be filled without throwing");
+
+public:
+    explicit mpmcRing(size_t p_cap) : m_cap(p_cap), m_cells(new Cell[p_cap]), m_head(0), m_tail(0)
+    {
+        if ( p_cap == 0 )
+            throw std::invalid_argument("mpmcRing: capacity must be at least 1");
+
+        for ( size_t i = 0; i < m_cap; ++i )
+            m_cells[i].m_seq.store(i, std::memory_order_relaxed);
+    }
+    ~mpmcRing() { while ( tryPop() ) {} }
+
+    mpmcRing(const mpmcRing&) = delete;
+    mpmcRing& operator=(const mpmcRing&) = delete;
+
+    /*!
+     * @brief tryPush
+     *        Never blocks: returns false if the ring is full,
+     *        in which case p_elm is left untouched.
+     */
+    template <typename U>
+    bool tryPush(U&& p_elm) { return tryEmplace(std::forward<U>(p_elm)); }
+
+    /*!
+     * @brief tryEmplace
+     *        Same as tryPush(), but builds the element in its cell
+     *        from p_args - unless that could throw, in which case it
+     *        is built first, and moved in: p_args are then used up
+     *        even if the ring turns out to be full.
+     */
+    template <typename... Args>
+    bool tryEmplace(Args&&... p_args)
+    {
+        // A claimed cell must be filled
+        if constexpr ( !std::is_nothrow_constructible_v<T, Args&&...> )
+        {
+            T l_elm(std::forward<Args>(p_args)...);
+            return tryEmplace(std::move(l_elm));
+        }
+        else
+        {
+            size_t l_pos = m_tail.load(std::memory_order_relaxed);
+            for (;;)
+            {
+                Cell&          l_cell = m_cells[l_pos % m_cap];
+                const size_t   l_seq  = l_cell.m_seq.load(std::memory_order_acquire);
+                std::ptrdiff_t l_diff = std::ptrdiff_t(l_seq - l_pos);
+
+                if ( l_diff == 0 )
+                {
+                    if ( m_tail.compare_exchange_weak(l_pos, l_pos + 1, std::memory_order_relaxed) )
+                    {
+                        ::new (l_cell.m_storage) T(std::forward<Args>(p_args)...);
+                        l_cell.m_seq.store(l_pos + 1, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if ( l_diff < 0 )
+                    return false; // The cell still holds the element of the previous lap
+                else
+                    l_pos = m_tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /*!
+     * @brief tryPop
+     *        Never blocks: returns std::nullopt if the ring is empty.
+     */
+    std::optional<T> tryPop()
+    {
+        std::optional<T> l_ret;
+        tryConsume([&l_ret](T& p_elm) { l_ret.emplace(std::move(p_elm)); });
+        return l_ret;
+    }
+
+    /*!
+     * @brief tryConsume
+     *        Never blocks: returns false if the ring is empty.
+     *        Otherwise calls p_fn on the oldest element, in its cell,
+     *        then destroys it - even if p_fn throws.
+     */
+    template <typename F>
+    bool tryConsume(F&& p_fn)
+    {
+        size_t l_pos = m_head.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Cell&          l_cell = m_cells[l_pos % m_cap];
+            const size_t   l_seq  = l_cell.m_seq.load(std::memory_order_acquire);
+            std::ptrdiff_t l_diff = std::ptrdiff_t(l_seq - (l_pos + 1));
+
+            if ( l_diff == 0 )
+            {
+                if ( m_head.compare_exchange_weak(l_pos, l_pos + 1, std::memory_order_relaxed) )
+                {
+                    struct Release
+                    {
+                        T*     m_elm;
+                        Cell&  m_cell;
+                        size_t m_seq;
+                        ~Release()
+                        {
+                            m_elm->~T();
+                            m_cell.m_seq.store(m_seq, std::memory_order_release);
+                        }
+                    } l_release{std::launder(reinterpret_cast<T*>(l_cell.m_storage)), l_cell, l_pos + m_cap};
+
+                    p_fn(*l_release.m_elm);
+                    return true;
+                }
+            }
+            else if ( l_diff < 0 )
+                return false; // The cell has not been filled yet
+            else
+                l_pos = m_head.load(std::memory_order_relaxed);
+        }
+    }
+
+    /*!
+     * @brief size
+     *        Only a snapshot when other threads are using the ring.
+     */
+    size_t size() const
+    {
+        const size_t l_head = m_head.load(std::memory_order_acquire);
+        const size_t l_tail = m_tail.load(std::memory_order_acquire);
+        return std::min(l_tail - l_head, m_cap);
+    }
+
+    size_t capacity() const { return m_cap; }
+
+private:
+    static constexpr size_t CACHE_LINE = 64;
+
+    struct Cell
+    {
+        std::atomic<size_t>               m_seq;
+        alignas(T) unsigned char          m_storage[sizeof(T)];
+    };
+
+    const size_t                          m_cap;   /*!< Number of cells                      */
+    std::unique_ptr<Cell[]>               m_cells; /*!< The ring itself                      */
+    alignas(CACHE_LINE) std::atomic<size_t> m_head; /*!< Position of the next pop  - own line */
+    alignas(CACHE_LINE) std::atomic<size_t> m_tail; /*!< Position of the next push - own line */
+};
+
+/*!
+ * @brief spscRing
+ *        Bounded wait-free single-producer/single-consumer ring
+ *        buffer: m_tail is only written by the producer, m_head
+ *        only by the consumer, and neither ever retries.
+ *        Each side also keeps a copy of the other's index, and
+ *        only reads the shared one again when the copy says the
+ *        ring is full (resp. empty): as long as they are apart,
+ *        producer and consumer do not touch each other's line.
+ */
+template <typename T>
+class spscRing
+{
+public:
+    explicit spscRing(size_t p_cap) : m_cap(p_cap), m_slots(new Slot[p_cap])
+    {
+        if ( p_cap == 0 )
+            throw std::invalid_argument("spscRing: capacity must be at least 1");
+    }
+    ~spscRing() { while ( tryPop() ) {} }
+
+    spscRing(const spscRing&) = delete;
+    spscRing& operator=(const spscRing&) = delete;
+
+    /*!
+     * @brief tryPush
+     *        Producer thread only. Returns false if the ring is
+     *        full, in which case p_elm is left untouched.
+     */
+    template <typename U>
+    bool tryPush(U&& p_elm) { return tryEmplace(std::forward<U>(p_elm)); }
+
+    /*!
+     * @brief tryEmplace
+     *        Same as tryPush(), but builds the element in its slot
+     *        from p_args.
+     */
+    template <typename... Args>
+    bool tryEmplace(Args&&... p_args)
+    {
+        const size_t l_tail = m_tail.load(std::memory_order_relaxed);
+        if ( l_tail - m_headCache == m_cap )
+        {
+            m_headCache = m_head.load(std::memory_order_acquire);
+            if ( l_tail - m_headCache == m_cap )
+                return false;
+        }
+
+        ::new (m_slots[l_tail % m_cap].m_storage) T(std::forward<Args>(p_args)...);
+        m_tail.store(l_tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /*!
+     * @brief tryPop
+     *        Consumer thread only. Returns std::nullopt if the ring
+     *        is empty.
+     */
+    std::optional<T> tryPop()
+    {
+        std::optional<T> l_ret;
+        tryConsume([&l_ret](T& p_elm) { l_ret.emplace(std::move(p_elm)); });
+        return l_ret;
+    }
+
+    /*!
+     * @brief tryConsume
+     *        Consumer thread only. Returns false if the ring is
+     *        empty. Otherwise calls p_fn on the oldest element, in
+     *        its slot, then destroys it - even if p_fn throws.
+     */
+    template <typename F>
+    bool tryConsume(F&& p_fn)
+    {
+        const size_t l_head = m_head.load(std::memory_order_relaxed);
+        if ( l_head == m_tailCache )
+        {
+            m_tailCache = m_tail.load(std::memory_order_acquire);
+            if ( l_head == m_tailCache )
+                return false;
+        }
+
+        struct Release
+        {
+            T*                   m_elm;
+            std::atomic<size_t>& m_head;
+            size_t               m_next;
+            ~Release()
+            {
+                m_elm->~T();
+                m_head.store(m_next, std::memory_order_release);
+            }
+        } l_release{std::launder(reinterpret_cast<T*>(m_slots[l_head % m_cap].m_storage)), m_head, l_head + 1};
+
+        p_fn(*l_release.m_elm);
+        return true;
+    }
+
+    /*!
+     * @brief size
+     *        Only a snapshot when other threads are using the ring.
+     */
+    size_t size() const
+    {
+        const size_t l_head = m_head.load(std::memory_order_acquire);
+        const size_t l_tail = m_tail.load(std::memory_order_acquire);
+        return std::min(l_tail - l_head, m_cap);
+    }
+
+    size_t capacity() const { return m_cap; }
+
+private:
+    static constexpr size_t CACHE_LINE = 64;
+
+    struct Slot
+    {
+        alignas(T) unsigned char m_storage[sizeof(T)];
+    };
+
+    const size_t                             m_cap;          /*!< Number of slots                      */
+    std::unique_ptr<Slot[]>                  m_slots;        /*!< The ring itself                      */
+    alignas(CACHE_LINE) std::atomic<size_t>  m_tail{0};      /*!< Position of the next push            */
+    size_t                                   m_headCache{0}; /*!< Producer's copy of m_head            */
+    alignas(CACHE_LINE) std::atomic<size_t>  m_head{0};      /*!< Position of the next pop             */
+    size_t                                   m_tailCache{0}; /*!< Consumer's copy of m_tail            */
+};
+
+/*!
+ * @brief scopeExit
+ *        Calls a function when leaving the scope - normally or
+ *        through an exception. Batch operations use it to tell
+ *        waiters about the elements they moved before a move threw.
+ */
+template <typename F>
+class scopeExit
+{
+public:
+    explicit scopeExit(F p_fn) : m_fn(std::move(p_fn)) {}
+    ~scopeExit() { m_fn(); }
+
+    scopeExit(const scopeExit&) = delete;
+    scopeExit& operator=(const scopeExit&) = delete;
+
+private:
+    F m_fn;
+};
+
+/*!
+ * @brief queueStatus
+ *        State and error model shared by all the queues below.
+ */
+class queueStatus
+{
+public:
+    enum State { OPENED, CLOSED };
+
+    enum class StatusCode { 
+        ERR_NO    ,  // No error
+        ERR_FULL  ,  // Capacity error - trying to push() on a queue that is full.
+        ERR_EMPTY ,  // Capacity error - trying to get() on a queue that is empty.
+        ERR_TIMOUT,  // Timeout error  - trying to get() or push() but timed out.
+        ERR_ACCESS   // Access error   - trying to get() or push() on CLOSED queue.
+    };
+
+    static std::string getStatus( StatusCode&& p_code ) { 
+        return m_statusStr.at(p_code); 
+    }
+
+    template <typename V>
+    static std::string getStatus( const std::variant<V, StatusCode>& p_code ) {
+        return ( std::holds_alternative<StatusCode>(p_code) ) ? 
+                m_statusStr.at(std::get<StatusCode>(p_code)) : 
+                m_statusStr.at(StatusCode::ERR_NO);
+    }
+
+protected:
+    /*!
+     * @brief deadlineIn
+     *        The time point p_ms from now - or the end of time, when
+     *        it is further than steady_clock can tell: waiting for
+     *        std::chrono::milliseconds::max() waits forever.
+     */
+    static std::chrono::steady_clock::time_point deadlineIn( const std::chrono::milliseconds& p_ms )
+    {
+        using Clock = std::chrono::steady_clock;
+
+        const auto l_now = Clock::now();
+        if ( p_ms <= std::chrono::milliseconds::zero() )
+            return l_now;
+
+        if ( p_ms >= std::chrono::duration_cast<std::chrono::milliseconds>(Clock::time_point::max() - l_now) )
+            return Clock::time_point::max();
+
+        return l_now + p_ms;
+    }
+
+private:
+    inline static const std::map<StatusCode, std::string> m_statusStr =
+        {
+            { StatusCode::ERR_NO     , "OK!\n"},
+            { StatusCode::ERR_FULL   , "Queue is full\n"},
+            { StatusCode::ERR_EMPTY  , "Queue is empty\n"},
+            { StatusCode::ERR_TIMOUT , "Timed out before end of operation\n"},
+            { StatusCode::ERR_ACCESS , "Trying to access closed queue\n"}
+    };
+};
+
+/*!
+ * @brief queueSignals
+ *        State, lock and condition variables of the queues that
+ *        block on a mutex: producers wait on m_push for room, and
+ *        consumers on m_pop for elements. Both stop waiting as soon
+ *        as the queue is closed.
+ */
+class queueSignals : public queueStatus
+{
+public:
+    bool isClosed() const { return m_state.load(std::memory_order_acquire) == State::CLOSED; }
+
+protected:
+    queueSignals() : m_state(OPENED) {}
+
+    /*!
+     * @brief closeLocked
+     *        Closes the queue and wakes every waiter up.
+     *        m_mtx must be held.
+     */
+    void closeLocked()
+    {
+        m_state = State::CLOSED;
+
+        m_push.notify_all();
+        m_pop .notify_all();
+    }
+
+    /*!
+     * @brief waitForRoom
+     *        Will block untill p_hasRoom() or the queue is closed
+     *        or p_deadline, then tell whether a push may go on.
+     *        Being closed prevails over being full.
+     */
+    template <typename HasRoom>
+    StatusCode waitForRoom( std::unique_lock<std::mutex>&                p_lck,
+                            const std::chrono::steady_clock::time_point& p_deadline,
+                            HasRoom                                      p_hasRoom )
+    {
+        // Wait untill "There is some place" OR "closed" OR "timeout"
+        m_push.wait_until(p_lck,
+                          p_deadline,
+                          [&] { return p_hasRoom() || m_state == State::CLOSED; });
+
+        if ( m_state == State::CLOSED )
+            return StatusCode::ERR_ACCESS;
+
+        if ( !p_hasRoom() )
+            return StatusCode::ERR_FULL;
+
+        return StatusCode::ERR_NO;
+    }
+
+    /*!
+     * @brief waitForElement
+     *        Will block untill p_hasElement() or the queue is closed
+     *        or p_deadline, then tell whether a pop may go on.
+     */
+    template <typename HasElement>
+    StatusCode waitForElement( std::unique_lock<std::mutex>&                p_lck,
+                               const std::chrono::steady_clock::time_point& p_deadline,
+                               HasElement                                   p_hasElement )
+    {
+        // Wait untill "There is one item" OR "closed" OR "timeout"
+        m_pop.wait_until(p_lck,
+                         p_deadline,
+                         [&] { return p_hasElement() || m_state == State::CLOSED; });
+
+        if ( !p_hasElement() )
+            return StatusCode::ERR_EMPTY;
+
+        if ( m_state == State::CLOSED )
+            return StatusCode::ERR_ACCESS;
+
+        return StatusCode::ERR_NO;
+    }
+
+    std::atomic<State>      m_state; /*!< State of the queue               */
+    std::mutex              m_mtx;   /*!< Mutex for operations             */
+    std::condition_variable m_push;  /*!< Condition variable for producers */
+    std::condition_variable m_pop ;  /*!< Condition variable for consumers */
+};
+
+/*!
+ * @brief queueWaiter
+ *        What a thread sleeping on several queues at once waits on:
+ *        the queues it is attached to bump its epoch whenever they
+ *        get elements, or get closed.
+ */
+class queueWaiter
+{
+public:
+    uint64_t epoch()
+    {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        return m_epoch;
+    }
+
+    void notify()
+    {
+        {
+            std::lock_guard<std::mutex> lck(m_mtx);
+            ++m_epoch;
+        }
+        m_cv.notify_one();
+    }
+
+    /*!
+     * @brief waitUntil
+     *        Will block untill the epoch moves past p_seen or timeout,
+     *        and tell which.
+     */
+    bool waitUntil( uint64_t p_seen, const std::chrono::steady_clock::time_point& p_deadline )
+    {
+        std::unique_lock<std::mutex> lck(m_mtx);
+        return m_cv.wait_until(lck, p_deadline, [&] { return m_epoch != p_seen; });
+    }
+
+private:
+    std::mutex              m_mtx;      /*!< Mutex for m_epoch                */
+    std::condition_variable m_cv;       /*!< Condition variable for m_epoch   */
+    uint64_t                m_epoch{0}; /*!< Number of notifications so far   */
+};
+
+template <typename T, queueBackend B>
+class queueSelector;
+
+template <typename T, queueBackend B = queueBackend::LOCKED>
+class queueThreadSafe : public queueSignals
+{
+public:
+    explicit queueThreadSafe(size_t p_cap = 0) : m_cap(p_cap), m_data(makeStorage(p_cap)) {}
+    ~queueThreadSafe()
+    {
+        close();
+#ifdef __linux__
+        if ( m_eventFd >= 0 )
+            ::close(m_eventFd);
+#endif
+    }
+
+    queueThreadSafe(const queueThreadSafe&) = delete;
+    queueThreadSafe& operator=(const queueThreadSafe&) = delete;
+
+    void close() 
+    { 
+        std::unique_lock<std::mutex> lck(m_mtx);
+        closeLocked();
+        notifyListeners();
+    }
+
+#ifdef __linux__
+    /*!
+     * @brief eventHandle
+     *        An eventfd that becomes readable when elements arrive
+     *        and when the queue is closed, to wait on many queues -
+     *        and sockets - at once with poll/epoll.
+     *        Once it is readable, a consumer must acknowledge() it,
+     *        then pop untill the queue says ERR_EMPTY: the handle
+     *        only fires again for elements pushed after that. It
+     *        may fire for elements those pops already took.
+     *        Created on first call, closed with the queue.
+     */
+    int eventHandle()
+    {
+        std::unique_lock<std::mutex> lck(m_mtx);
+        if ( m_eventFd < 0 )
+        {
+            const int l_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if ( l_fd < 0 )
+                throw std::runtime_error("queueThreadSafe: eventfd() failed");
+            m_eventFd.store(l_fd);
+
+            // Elements may be there already - including ones pushed
+            // by producers that have not seen m_eventFd yet.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if ( m_state == State::CLOSED || m_data.size() != 0 )
+                notifyListeners();
+        }
+        return m_eventFd;
+    }
+
+    void acknowledge()
+    {
+        const int l_fd = m_eventFd.load(std::memory_order_acquire);
+        if ( l_fd < 0 )
+            return;
+
+        uint64_t l_count;
+        (void)!::read(l_fd, &l_count, sizeof(l_count));
+
+        // Re-arm before looking at the queue: an element pushed from
+        // now on either is seen by the pops that follow, or fires
+        // the handle again.
+        m_signalled.store(false);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+#endif
+
+    /*
+     * @brief push
+     *        Will block in case of full queue untill timeout
+     *        or space appears.
+     */
+    [[maybe_unused]] StatusCode push( const T &  p_elm, 
+                                      uint32_t&& p_ms = 2000 )
+    {
+        return emplaceUntil(std::chrono::steady_clock::now() + std::chrono::milliseconds(p_ms), p_elm);
+    }
+
+    [[maybe_unused]] StatusCode push(T &&p_elm,
+                                     uint32_t &&p_ms = 2000 )
+    {
+        return emplaceUntil(std::chrono::steady_clock::now() + std::chrono::milliseconds(p_ms), std::move(p_elm));
+    }
+
+    /*!
+     * @brief emplace
+     *        Same as push(), but builds the element straight in the
+     *        queue's storage, from p_args. Like pop(), waits for room
+     *        for as long as it takes, or untill the queue is closed:
+     *        emplaceFor() is the timed version.
+     */
+    template <typename... Args>
+    [[maybe_unused]] StatusCode emplace( Args&&... p_args )
+    {
+        return emplaceUntil(std::chrono::steady_clock::time_point::max(), std::forward<Args>(p_args)...);
+    }
+
+    template <typename... Args>
+    [[maybe_unused]] StatusCode emplaceFor( std::chrono::milliseconds&& p_ms, Args&&... p_args )
+    {
+        return emplaceUntil(deadlineIn(p_ms), std::forward<Args>(p_args)...);
+    }
+
+    /*!
+     * @brief pop
+     *        Will return a std::variant that contains
+     *        a value if possible, otherwise the corresponding StatusCode.
+     *        Without a timeout, waits for as long as it takes for an
+     *        element to come or for the queue to be closed.
+     */
+    std::variant<T, StatusCode> pop( std::chrono::milliseconds &&p_ms )
+    {
+        return popUntil(deadlineIn(p_ms));
+    }
+
+    std::variant<T, StatusCode> pop()
+    {
+        return popUntil(std::chrono::steady_clock::time_point::max());
+    }
+
+    /*!
+     * @brief consume
+     *        Same as pop(), but rather than moving the element out,
+     *        calls p_fn on it where it lies, then destroys it - even
+     *        if p_fn throws. Will return the StatusCode of the pop.
+     *        With the LOCKED backend, p_fn runs under the queue lock.
+     */
+    template <typename F>
+    StatusCode consume( F&& p_fn, std::chrono::milliseconds &&p_ms )
+    {
+        return consumeUntil(p_fn, deadlineIn(p_ms));
+    }
+
+    template <typename F>
+    StatusCode consume( F&& p_fn )
+    {
+        return consumeUntil(p_fn, std::chrono::steady_clock::time_point::max());
+    }
+
+    /*!
+     * @brief tryPop
+     *        Same as pop(), but never waits.
+     */
+    std::variant<T, StatusCode> tryPop()
+    {
+        if constexpr ( B == queueBackend::LOCKED )
+        {
+            std::unique_lock<std::mutex> lck(m_mtx);
+            if ( m_data.empty() )
+                return StatusCode::ERR_EMPTY;
+
+            if ( m_state == State::CLOSED )
+                return StatusCode::ERR_ACCESS;
+
+            T l_ret = std::move(m_data.front());
+            m_data.pop_front();
+            m_push.notify_one();
+
+            return l_ret;
+        }
+        else
+        {
+            if ( m_state.load(std::memory_order_acquire) == State::CLOSED )
+                return m_data.size() == 0 ? StatusCode::ERR_EMPTY : StatusCode::ERR_ACCESS;
+
+            auto l_elm = m_data.tryPop();
+            if ( !l_elm )
+                return StatusCode::ERR_EMPTY;
+
+            wake(m_push, m_pushWaiters);
+            return std::move(*l_elm);
+        }
+    }
+
+    /*!
+     * @brief push_range
+     *        Pushes [p_first, p_last) in order, as many elements as
+     *        there is room for under each lock, and waits for more
+     *        room untill timeout.
+     *        Will return the number of elements pushed, or the
+     *        StatusCode that prevented pushing any.
+     */
+    template <typename InputIt>
+    std::variant<size_t, StatusCode> push_range( InputIt    p_first,
+                                                 InputIt    p_last,
+                                                 uint32_t&& p_ms = 2000 )
+    {
+        if constexpr ( B == queueBackend::LOCKED )
+            return pushRangeLocked(p_first, p_last, p_ms);
+        else
+            return pushRangeLockFree(p_first, p_last, p_ms);
+    }
+
+    /*!
+     * @brief pop_up_to
+     *        Waits for at least one element untill timeout, then
+     *        pops up to p_n elements at once into p_out.
+     *        Will return the number of elements popped, or the
+     *        corresponding StatusCode.
+     *        Without a timeout, waits as pop() does.
+     */
+    template <typename OutputIt>
+    std::variant<size_t, StatusCode> pop_up_to( size_t                      p_n,
+                                                OutputIt                    p_out,
+                                                std::chrono::milliseconds&& p_ms )
+    {
+        return popUpToUntil(p_n, p_out, deadlineIn(p_ms));
+    }
+
+    template <typename OutputIt>
+    std::variant<size_t, StatusCode> pop_up_to( size_t p_n, OutputIt p_out )
+    {
+        return popUpToUntil(p_n, p_out, std::chrono::steady_clock::time_point::max());
+    }
+
+    /*!
+     * @brief drain
+     *        Pops every element in the queue without waiting.
+     *        Unlike pop(), also works on a CLOSED queue, which lets
+     *        the last consumer collect what is left.
+     *        With the SPSC backend, only the consumer may call it.
+     */
+    std::vector<T> drain()
+    {
+        std::vector<T> l_ret;
+        if constexpr ( B == queueBackend::LOCKED )
+        {
+            std::unique_lock<std::mutex> lck(m_mtx);
+            scopeExit l_notify([&] { if ( !l_ret.empty() ) m_push.notify_all(); });
+
+            l_ret.reserve(m_data.size());
+            for ( ; !m_data.empty(); m_data.pop_front() )
+                l_ret.push_back(std::move(m_data.front()));
+        }
+        else
+        {
+            // An element whose move throws is lost, but still counted
+            size_t    l_taken = 0;
+            scopeExit l_wake([&] { wake(m_push, m_pushWaiters, l_taken); });
+
+            while ( auto l_elm = m_data.tryPop() )
+            {
+                ++l_taken;
+                l_ret.push_back(std::move(*l_elm));
+            }
+        }
+        return l_ret;
+    }
+
+private:
+    friend class queueSelector<T, B>;
+
+    void attach( queueWaiter* p_waiter )
+    {
+        {
+            std::lock_guard<std::mutex> lck(m_listenersMtx);
+            m_listeners.push_back(p_waiter);
+            m_listenerCount.fetch_add(1);
+        }
+        // Producers that have not seen it yet have published their
+        // elements already: the waiter's owner looks after attaching.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    void detach( queueWaiter* p_waiter )
+    {
+        std::lock_guard<std::mutex> lck(m_listenersMtx);
+        m_listeners.erase(std::find(m_listeners.begin(), m_listeners.end(), p_waiter));
+        m_listenerCount.fetch_sub(1);
+    }
+
+    template <typename... Args>
+    StatusCode emplaceUntil( const std::chrono::steady_clock::time_point& p_deadline, Args&&... p_args )
+    {
+        if constexpr ( B == queueBackend::LOCKED )
+            return emplaceLocked(p_deadline, std::forward<Args>(p_args)...);
+        else
+            return emplaceLockFree(p_deadline, std::forward<Args>(p_args)...);
+    }
+
+    std::variant<T, StatusCode> popUntil( const std::chrono::steady_clock::time_point& p_deadline )
+    {
+        // The element is moved once, from the storage into the result
+        std::variant<T, StatusCode> l_ret(std::in_place_index<1>, StatusCode::ERR_NO);
+        auto             l_take   = [&l_ret](T& p_elm) { l_ret.template emplace<0>(std::move(p_elm)); };
+        const StatusCode l_status = consumeUntil(l_take, p_deadline);
+
+        if ( l_status != StatusCode::ERR_NO )
+            l_ret.template emplace<1>(l_status);
+        return l_ret;
+    }
+
+    template <typename OutputIt>
+    std::variant<size_t, StatusCode> popUpToUntil( size_t                                       p_n,
+                                                   OutputIt                                     p_out,
+                                                   const std::chrono::steady_clock::time_point& p_deadline )
+    {
+        if ( p_n == 0 )
+            return size_t(0);
+
+        if constexpr ( B == queueBackend::LOCKED )
+            return popUpToLocked(p_n, p_out, p_deadline);
+        else
+            return popUpToLockFree(p_n, p_out, p_deadline);
+    }
+
+    template <typename F>
+    StatusCode consumeUntil( F& p_fn, const std::chrono::steady_clock::time_point& p_deadline )
+    {
+        if constexpr ( B == queueBackend::LOCKED )
+            return consumeLocked(p_fn, p_deadline);
+        else
+            return consumeLockFree(p_fn, p_deadline);
+    }
+
+    using Storage = std::conditional_t<B == queueBackend::LOCKED, segmentedBuffer<T>,
+                    std::conditional_t<B == queueBackend::MPMC,   mpmcRing<T>, spscRing<T>>>;
+
+    static Storage makeStorage(size_t p_cap)
+    {
+        if constexpr ( B == queueBackend::LOCKED )
+            return Storage();
+        else
+            return Storage(p_cap);
+    }
+
+    template <typename... Args>
+    StatusCode emplaceLocked( const std::chrono::steady_clock::time_point& p_deadline, Args&&... p_args )
+    {
+        std::unique_lock<std::mutex> lck(m_mtx);
+
+        const StatusCode l_status = waitForRoom(lck, p_deadline, [this] { return m_data.size() < m_cap; });
+        if ( l_status != StatusCode::ERR_NO )
+            return l_status;
+
+        m_data.emplace_back(std::forward<Args>(p_args)...);
+        m_pop.notify_one();
+        notifyListeners();
+
+        return StatusCode::ERR_NO;
+    }
+
+    template <typename F>
+    StatusCode consumeLocked( F& p_fn, const std::chrono::steady_clock::time_point& p_deadline )
+    {
+        std::unique_lock<std::mutex> lck(m_mtx);
+
+        const StatusCode l_status = waitForElement(lck, p_deadline, [this] { return !m_data.empty(); });
+        if ( l_status != StatusCode::ERR_NO )
+            return l_status;
+
+        struct Release
+        {
+            queueThreadSafe& m_queue;
+            ~Release()
+            {
+                m_queue.m_data.pop_front();
+                m_queue.m_push.notify_one();
+            }
+        } l_release{*this};
+
+        p_fn(m_data.front());
+        return StatusCode::ERR_NO;
+    }
+
+    template <typename InputIt>
+    std::variant<size_t, StatusCode> pushRangeLocked( InputIt p_first, InputIt p_last, uint32_t p_ms )
+    {
+        const auto   l_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(p_ms);
+        size_t       l_pushed   = 0;
+        StatusCode   l_status   = StatusCode::ERR_NO;
+
+        std::unique_lock<std::mutex> lck(m_mtx);
+        while ( p_first != p_last )
+        {
+            l_status = waitForRoom(lck, l_deadline, [this] { return m_data.size() < m_cap; });
+            if ( l_status != StatusCode::ERR_NO )
+                break;
+
+            const size_t l_before = l_pushed;
+            scopeExit    l_notify([&] {
+                if ( l_pushed == l_before )
+                    return;
+                if ( l_pushed - l_before > 1 ) m_pop.notify_all();
+                else                           m_pop.notify_one();
+                notifyListeners();
+            });
+
+            for ( ; p_first != p_last && m_data.size() < m_cap; ++p_first, ++l_pushed )
+                m_data.emplace_back(*p_first);
+        }
+
+        if ( l_pushed == 0 && l_status != StatusCode::ERR_NO )
+            return l_status;
+        return l_pushed;
+    }
+
+    template <typename OutputIt>
+    std::variant<size_t, StatusCode> popUpToLocked( size_t p_n, OutputIt p_out, const std::chrono::steady_clock::time_point& p_deadline )
+    {
+        std::unique_lock<std::mutex> lck(m_mtx);
+
+        const StatusCode l_status = waitForElement(lck, p_deadline, [this] { return !m_data.empty(); });
+        if ( l_status != StatusCode::ERR_NO )
+            return l_status;
+
+        const size_t l_count  = std::min(p_n, m_data.size());
+        size_t       l_popped = 0;
+        scopeExit    l_notify([&] {
+            if ( l_popped > 1 )       m_push.notify_all();
+            else if ( l_popped == 1 ) m_push.notify_one();
+        });
+
+        for ( ; l_popped < l_count; ++p_out )
+        {
+            *p_out = std::move(m_data.front());
+            m_data.pop_front();
+            ++l_popped;
+        }
+
+        return l_count;
+    }
+
+    /*
+     * Lock-free backends only take m_mtx to sleep: a thread that has
+     * to wait registers in m_pushWaiters/m_popWaiters, and the other
+     * side only locks and notifies when it sees someone registered.
+     * Both sides fence between their write and their read of the
+     * other's, so that one of them always sees the other.
+     */
+    void wake(std::condition_variable& p_cv, const std::atomic<uint32_t>& p_waiters, size_t p_count = 1)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if ( p_count == 0 || p_waiters.load(std::memory_order_relaxed) == 0 )
+            return;
+
+        { std::lock_guard<std::mutex> lck(m_mtx); }
+        if ( p_count > 1 ) p_cv.notify_all();
+        else               p_cv.notify_one();
+    }
+
+    template <typename Predicate>
+    bool sleep(std::unique_lock<std::mutex>&                 p_lck,
+               std::condition_variable&                      p_cv,
+               std::atomic<uint32_t>&                        p_waiters,
+               const std::chrono::steady_clock::time_point&  p_deadline,
+               Predicate                                     p_ready)
+    {
+        p_waiters.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        const bool l_ready = p_cv.wait_until(p_lck, p_deadline, p_ready);
+        p_waiters.fetch_sub(1, std::memory_order_relaxed);
+        return l_ready;
+    }
+
+    template <typename... Args>
+    StatusCode emplaceLockFree(const std::chrono::steady_clock::time_point& p_deadline, Args&&... p_args)
+    {
+        // mpmcRing would build such an element anew on every try
+        if constexpr ( B == queueBackend::MPMC && !std::is_nothrow_constructible_v<T, Args&&...> )
+            return emplaceLockFree(p_deadline, T(std::forward<Args>(p_args)...));
+
+        for (;;)
+        {
+            if ( m_state.load(std::memory_order_acquire) == State::CLOSED )
+                return StatusCode::ERR_ACCESS;
+
+            // tryEmplace() only uses p_args up when it succeeds
+            if ( m_data.tryEmplace(std::forward<Args>(p_args)...) )
+            {
+                wake(m_pop, m_popWaiters);
+                notifyListeners();
+                return StatusCode::ERR_NO;
+            }
+
+            std::unique_lock<std::mutex> lck(m_mtx);
+            if ( !sleep(lck, m_push, m_pushWaiters, p_deadline,
+                        [this] { return m_data.size() < m_data.capacity() || m_state == State::CLOSED; }) )
+                return StatusCode::ERR_FULL;
+        }
+    }
+
+    template <typename F>
+    StatusCode consumeLockFree(F& p_fn, const std::chrono::steady_clock::time_point& p_deadline)
+    {
+        for (;;)
+        {
+            if ( m_state.load(std::memory_order_acquire) == State::CLOSED )
+                return m_data.size() == 0 ? StatusCode::ERR_EMPTY : StatusCode::ERR_ACCESS;
+
+            bool l_consumed;
+            try
+            {
+                l_consumed = m_data.tryConsume(p_fn);
+            }
+            catch (...)
+            {
+                wake(m_push, m_pushWaiters);
+                throw;
+            }
+
+            if ( l_consumed )
+            {
+                wake(m_push, m_pushWaiters);
+                return StatusCode::ERR_NO;
+            }
+
+            std::unique_lock<std::mutex> lck(m_mtx);
+            if ( !sleep(lck, m_pop, m_popWaiters, p_deadline,
+                        [this] { return m_data.size() != 0 || m_state == State::CLOSED; }) )
+                return StatusCode::ERR_EMPTY;
+        }
+    }
+
+    template <typename InputIt>
+    std::variant<size_t, StatusCode> pushRangeLockFree( InputIt p_first, InputIt p_last, uint32_t p_ms )
+    {
+        const auto l_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(p_ms);
+        size_t     l_pushed   = 0;
+        StatusCode l_status   = StatusCode::ERR_NO;
+
+        while ( p_first != p_last )
+        {
+            if ( m_state.load(std::memory_order_acquire) == State::CLOSED )
+            {
+                l_status = StatusCode::ERR_ACCESS;
+                break;
+            }
+
+            {
+                const size_t l_before = l_pushed;
+                scopeExit    l_wake([&] {
+                    wake(m_pop, m_popWaiters, l_pushed - l_before);
+                    if ( l_pushed != l_before )
+                        notifyListeners();
+                });
+
+                for ( ; p_first != p_last && m_data.tryPush(*p_first); ++p_first )
+                    ++l_pushed;
+            }
+
+            if ( p_first == p_last )
+                break;
+
+            std::unique_lock<std::mutex> lck(m_mtx);
+            if ( !sleep(lck, m_push, m_pushWaiters, l_deadline,
+                        [this] { return m_data.size() < m_data.capacity() || m_state == State::CLOSED; }) )
+            {
+                l_status = StatusCode::ERR_FULL;
+                break;
+            }
+        }
+
+        if ( l_pushed == 0 && l_status != StatusCode::ERR_NO )
+            return l_status;
+        return l_pushed;
+    }
+
+    template <typename OutputIt>
+    std::variant<size_t, StatusCode> popUpToLockFree( size_t p_n, OutputIt p_out, const std::chrono::steady_clock::time_point& p_deadline )
+    {
+        for (;;)
+        {
+            if ( m_state.load(std::memory_order_acquire) == State::CLOSED )
+                return m_data.size() == 0 ? StatusCode::ERR_EMPTY : StatusCode::ERR_ACCESS;
+
+            // An element whose move throws is lost, but still counted
+            size_t l_count = 0;
+            {
+                scopeExit l_wake([&] { wake(m_push, m_pushWaiters, l_count); });
+
+                for ( ; l_count < p_n; ++p_out )
+                {
+                    auto l_elm = m_data.tryPop();
+                    if ( !l_elm )
+                        break;
+                    ++l_count;
+                    *p_out = std::move(*l_elm);
+                }
+            }
+
+            if ( l_count != 0 )
+                return l_count;
+
+            std::unique_lock<std::mutex> lck(m_mtx);
+            if ( !sleep(lck, m_pop, m_popWaiters, p_deadline,
+                        [this] { return m_data.size() != 0 || m_state == State::CLOSED; }) )
+                return StatusCode::ERR_EMPTY;
+        }
+    }
+
+    /*
+     * Tells whoever watches the queue from outside that elements
+     * came, or that it was closed: fires the eventfd, if any, unless
+     * it already has since the last acknowledge(), and notifies the
+     * attached waiters. Callers have published their element, or
+     * closed the queue, before: on the lock-free path, wake() has
+     * fenced already.
+     */
+    void notifyListeners()
+    {
+#ifdef __linux__
+        const int l_fd = m_eventFd.load(std::memory_order_acquire);
+        if ( l_fd >= 0 && !m_signalled.load() && !m_signalled.exchange(true) )
+        {
+            uint64_t l_one = 1;
+            (void)!::write(l_fd, &l_one, sizeof(l_one));
+        }
+#endif
+        if ( m_listenerCount.load() == 0 )
+            return;
+
+        std::lock_guard<std::mutex> lck(m_listenersMtx);
+        for ( queueWaiter* l_waiter : m_listeners )
+            l_waiter->notify();
+    }
+
+    size_t                  m_cap;   /*!< Capacity of the queue            */
+    Storage                 m_data;  /*!< Underlying container             */
+    std::atomic<uint32_t>   m_pushWaiters{0}; /*!< Producers waiting (lock-free) */
+    std::atomic<uint32_t>   m_popWaiters {0}; /*!< Consumers waiting (lock-free) */
+#ifdef __linux__
+    std::atomic<int>        m_eventFd{-1};      /*!< eventfd, once asked for       */
+    std::atomic<bool>       m_signalled{false}; /*!< eventfd fired, not yet acked  */
+#endif
+    std::mutex                m_listenersMtx;     /*!< Mutex for m_listeners         */
+    std::vector<queueWaiter*> m_listeners;        /*!< Attached waiters              */
+    std::atomic<uint32_t>     m_listenerCount{0}; /*!< Size of m_listeners           */
+};
+
+/*!
+ * @brief queueSelector
+ *        Pops from whichever of several queues has an element first,
+ *        and tells which one it came from. A single waiter, attached
+ *        to all of them, is notified by their pushes: the latency of
+ *        pop() does not depend on the number of queues.
+ *        Queues are drained in weighted round-robin: the queue of
+ *        index i gives up to p_weights[i] elements in a row - 1 by
+ *        default - before the next one that has elements gets its
+ *        turn.
+ *        The queues must outlive the selector, and, with the SPSC
+ *        backend, it must be their only consumer.
+ */
+template <typename T, queueBackend B = queueBackend::LOCKED>
+class queueSelector : public queueStatus
+{
+public:
+    using Queue = queueThreadSafe<T, B>;
+
+    explicit queueSelector( std::vector<Queue*> p_queues, std::vector<uint32_t> p_weights = {} )
+        : m_queues(std::move(p_queues)), m_weights(std::move(p_weights))
+    {
+        if ( m_weights.empty() )
+            m_weights.assign(m_queues.size(), 1);
+
+        if ( m_queues.empty() || m_weights.size() != m_queues.size() ||
+             std::find(m_weights.begin(), m_weights.end(), 0u) != m_weights.end() )
+            throw std::invalid_argument("queueSelector: one non-zero weight per queue expected");
+
+        m_credit = m_weights[0];
+        for ( Queue* l_queue : m_queues )
+            l_queue->attach(&m_waiter);
+    }
+    ~queueSelector()
+    {
+        for ( Queue* l_queue : m_queues )
+            l_queue->detach(&m_waiter);
+    }
+
+    queueSelector(const queueSelector&) = delete;
+    queueSelector& operator=(const queueSelector&) = delete;
+
+    /*!
+     * @brief pop
+     *        Will return a std::variant that contains the index of the
+     *        queue and the element, otherwise the corresponding
+     *        StatusCode - ERR_ACCESS once all the queues are closed.
+     *        Without a timeout, waits for as long as it takes.
+     */
+    std::variant<std::pair<size_t, T>, StatusCode> pop( std::chrono::milliseconds &&p_ms )
+    {
+        return popUntil(deadlineIn(p_ms));
+    }
+
+    std::variant<std::pair<size_t, T>, StatusCode> pop()
+    {
+        return popUntil(std::chrono::steady_clock::time_point::max());
+    }
+
+private:
+    std::variant<std::pair<size_t, T>, StatusCode> popUntil( const std::chrono::steady_clock::time_point& p_deadline )
+    {
+        for (;;)
+        {
+            // Read before looking: a push we miss bumps it afterwards
+            const uint64_t l_epoch  = m_waiter.epoch();
+            bool           l_closed = true;
+
+            for ( size_t k = 0; k < m_queues.size(); ++k )
+            {
+                const size_t l_index = (m_cursor + k) % m_queues.size();
+
+                auto l_maybe = m_queues[l_index]->tryPop();
+                if ( std::holds_alternative<T>(l_maybe) )
+                {
+                    take(l_index);
+                    return std::make_pair(l_index, std::move(std::get<T>(l_maybe)));
+                }
+
+                l_closed = l_closed && m_queues[l_index]->isClosed();
+            }
+
+            if ( l_closed )
+                return StatusCode::ERR_ACCESS;
+
+            if ( !m_waiter.waitUntil(l_epoch, p_deadline) )
+                return StatusCode::ERR_EMPTY;
+        }
+    }
+
+    // Spends one credit of the queue that gave an element
+    void take( size_t p_index )
+    {
+        if ( p_index != m_cursor )
+        {
+            m_cursor = p_index;
+            m_credit = m_weights[p_index];
+        }
+
+        if ( --m_credit == 0 )
+        {
+            m_cursor = (m_cursor + 1) % m_queues.size();
+            m_credit = m_weights[m_cursor];
+        }
+    }
+
+    std::vector<Queue*>   m_queues;    /*!< Queues to pop from                  */
+    std::vector<uint32_t> m_weights;   /*!< Elements in a row, per queue        */
+    queueWaiter           m_waiter;    /*!< Notified by the queues              */
+    size_t                m_cursor{0}; /*!< Queue whose turn it is              */
+    uint32_t              m_credit{0}; /*!< Elements left in its turn           */
+};
+
+/*!
+ * @brief shardedQueueThreadSafe
+ *        Spreads elements over several queueThreadSafe - its shards -
+ *        so that producers and consumers running on different
+ *        threads mostly work on different locks.
+ *        Every thread has a home shard: it pushes there, unless it
+ *        is full, and pops from there, unless it is empty, in which
+ *        case it takes from the others. Consumers that find every
+ *        shard empty sleep on the sharded queue itself, which
+ *        producers only notify when someone sleeps.
+ *
+ * @note  Ordering is relaxed: elements keep their order within a
+ *        shard, so those of one producer come out in order as long
+ *        as its home shard never fills up - and are only popped by
+ *        one consumer. Nothing is guaranteed between producers.
+ */
+template <typename T, queueBackend B = queueBackend::LOCKED>
+class shardedQueueThreadSafe : public queueStatus
+{
+    static_assert(B != queueBackend::SPSC, "shards are shared by several producers and consumers");
+
+public:
+    using Shard = queueThreadSafe<T, B>;
+
+    /*!
+     * @brief shardedQueueThreadSafe
+     *        p_cap is split evenly between the shards - one per
+     *        hardware thread by default.
+     */
+    explicit shardedQueueThreadSafe( size_t p_cap, size_t p_shards = std::thread::hardware_concurrency() )
+    {
+        p_shards = std::max<size_t>(1, p_shards);
+        for ( size_t i = 0; i < p_shards; ++i )
+            m_shards.push_back(std::make_unique<Shard>((p_cap + p_shards - 1) / p_shards));
+    }
+    ~shardedQueueThreadSafe() { close(); }
+
+    shardedQueueThreadSafe(const shardedQueueThreadSafe&) = delete;
+    shardedQueueThreadSafe& operator=(const shardedQueueThreadSafe&) = delete;
+
+    void close()
+    {
+        for ( auto& l_shard : m_shards )
+            l_shard->close();
+
+        {
+            std::lock_guard<std::mutex> lck(m_mtx);
+            ++m_epoch;
+        }
+        m_pop.notify_all();
+    }
+
+    /*
+     * @brief push
+     *        Will block in case of full home shard - and other
+     *        shards full as well - untill timeout or space appears
+     *        in the home shard.
+     */
+    [[maybe_unused]] StatusCode push( const T& p_elm, uint32_t&& p_ms = 2000 ) { return pushImpl(p_elm, p_ms); }
+    [[maybe_unused]] StatusCode push( T&&      p_elm, uint32_t&& p_ms = 2000 ) { return pushImpl(std::move(p_elm), p_ms); }
+
+    /*!
+     * @brief pop
+     *        Will return a std::variant that contains
+     *        a value if possible, otherwise the corresponding StatusCode.
+     *        Without a timeout, waits for as long as it takes for an
+     *        element to come or for the queue to be closed.
+     */
+    std::variant<T, StatusCode> pop( std::chrono::milliseconds &&p_ms )
+    {
+        return popUntil(deadlineIn(p_ms));
+    }
+
+    std::variant<T, StatusCode> pop()
+    {
+        return popUntil(std::chrono::steady_clock::time_point::max());
+    }
+
+    size_t shards() const { return m_shards.size(); }
+
+private:
+    // The home shard of the calling thread: threads are numbered in
+    // the order they first use a sharded queue.
+    size_t home() const
+    {
+        static std::atomic<size_t> s_threads{0};
+        thread_local const size_t  l_thread = s_threads.fetch_add(1, std::memory_order_relaxed);
+        return l_thread % m_shards.size();
+    }
+
+    template <typename U>
+    StatusCode pushImpl( U&& p_elm, uint32_t p_ms )
+    {
+        const size_t l_home = home();
+
+        // A shard's push only moves from p_elm when it succeeds
+        StatusCode l_status = StatusCode::ERR_FULL;
+        for ( size_t k = 0; k < m_shards.size() && l_status == StatusCode::ERR_FULL; ++k )
+            l_status = m_shards[(l_home + k) % m_shards.size()]->push(std::forward<U>(p_elm), 0);
+
+        if ( l_status == StatusCode::ERR_FULL )
+            l_status = m_shards[l_home]->push(std::forward<U>(p_elm), uint32_t(p_ms));
+
+        if ( l_status == StatusCode::ERR_NO )
+            wake();
+        return l_status;
+    }
+
+    std::variant<T, StatusCode> popUntil( const std::chrono::steady_clock::time_point& p_deadline )
+    {
+        const size_t l_home = home();
+        for (;;)
+        {
+            auto l_maybe = scan(l_home);
+            if ( std::holds_alternative<T>(l_maybe) || std::get<StatusCode>(l_maybe) != StatusCode::ERR_TIMOUT )
+                return l_maybe;
+
+            // Register, then look again: a producer either sees us
+            // sleeping, or pushed before the second scan.
+            uint64_t l_epoch;
+            {
+                std::lock_guard<std::mutex> lck(m_mtx);
+                l_epoch = m_epoch;
+                m_sleepers.fetch_add(1);
+            }
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            l_maybe = scan(l_home);
+            if ( std::holds_alternative<T>(l_maybe) || std::get<StatusCode>(l_maybe) != StatusCode::ERR_TIMOUT )
+            {
+                m_sleepers.fetch_sub(1);
+                return l_maybe;
+            }
+
+            std::unique_lock<std::mutex> lck(m_mtx);
+            const bool l_woken = m_pop.wait_until(lck, p_deadline, [&] { return m_epoch != l_epoch; });
+            m_sleepers.fetch_sub(1);
+
+            if ( !l_woken )
+                return StatusCode::ERR_EMPTY;
+        }
+    }
+
+    /*
+     * Tries the home shard, then the others. Will return an element,
+     * the StatusCode pop() ends with once all shards are closed, or
+     * ERR_TIMOUT when it is worth waiting.
+     */
+    std::variant<T, StatusCode> scan( size_t p_home )
+    {
+        bool l_closed = true, l_left = false;
+        for ( size_t k = 0; k < m_shards.size(); ++k )
+        {
+            Shard& l_shard = *m_shards[(p_home + k) % m_shards.size()];
+
+            auto l_maybe = l_shard.tryPop();
+            if ( std::holds_alternative<T>(l_maybe) )
+                return l_maybe;
+
+            l_left   = l_left   || std::get<StatusCode>(l_maybe) == StatusCode::ERR_ACCESS;
+            l_closed = l_closed && l_shard.isClosed();
+        }
+
+        if ( !l_closed )
+            return StatusCode::ERR_TIMOUT;
+        return l_left ? StatusCode::ERR_ACCESS : StatusCode::ERR_EMPTY;
+    }
+
+    void wake()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if ( m_sleepers.load(std::memory_order_relaxed) == 0 )
+            return;
+
+        {
+            std::lock_guard<std::mutex> lck(m_mtx);
+            ++m_epoch;
+        }
+        m_pop.notify_one();
+    }
+
+    std::vector<std::unique_ptr<Shard>> m_shards;      /*!< The sub-queues                       */
+    std::mutex                          m_mtx;         /*!< Mutex for m_epoch                    */
+    std::condition_variable             m_pop;         /*!< Condition variable for consumers     */
+    uint64_t                            m_epoch{0};    /*!< Pushes seen by sleeping consumers    */
+    std::atomic<uint32_t>               m_sleepers{0}; /*!< Consumers sleeping, or about to      */
+};
+
 /*!
- * @brief queueThreadSafe
- *        push() and pop() operations can only be performed if 
- *        the queue state is OPENED.
- *        These operations also have a settable timeout and will
- *        give an indication of success/failure:
- *              - through a bool for push()
- *              - through std::optional for pop()
+ * @brief stableHeap
+ *        Binary heap over a std::vector, whose top is the greatest
+ *        element according to Compare - and, among equal ones, the
+ *        oldest, which std::priority_queue does not guarantee.
+ *        Not thread-safe.
  */
+template <typename T, typename Compare>
+class stableHeap
+{
+public:
+    explicit stableHeap(Compare p_cmp = Compare()) : m_cmp(std::move(p_cmp)) {}
+
+    template <typename U>
+    void push(U&& p_elm)
+    {
+        m_data.push_back(Entry{T(std::forward<U>(p_elm)), m_seq++});
+        std::push_heap(m_data.begin(), m_data.end(), before());
+    }
+
+    const T& top() const { return m_data.front().m_elm; }
+
+    T pop()
+    {
+        std::pop_heap(m_data.begin(), m_data.end(), before());
+        T l_ret = std::move(m_data.back().m_elm);
+        m_data.pop_back();
+        return l_ret;
+    }
+
+    bool   empty() const { return m_data.empty(); }
+    size_t size()  const { return m_data.size();  }
+
+private:
+    struct Entry
+    {
+        T        m_elm;
+        uint64_t m_seq; /*!< Order of insertion, to break ties */
+    };
+
+    // Whether p_lhs comes out of the heap after p_rhs
+    auto before() const
+    {
+        return [this](const Entry& p_lhs, const Entry& p_rhs) {
+            if ( m_cmp(p_lhs.m_elm, p_rhs.m_elm) ) return true;
+            if ( m_cmp(p_rhs.m_elm, p_lhs.m_elm) ) return false;
+            return p_lhs.m_seq > p_rhs.m_seq;
+        };
+    }
+
+    Compare            m_cmp;
+    std::vector<Entry> m_data;
+    uint64_t           m_seq{0};
+};
 
 /*!
- * @note We will make use of some C++17 features
- *       such as std::variant for error-handling.
- * 
- * You can find more informations about std::variant
- * here https://en.cppreference.com/w/cpp/utility/variant
- * and some tests on it here 
- * https://github.com/MericLuc/Cpp17-Features-tests/std-variant
+ * @brief priorityQueueThreadSafe
+ *        Same interface and semantics as queueThreadSafe, except
+ *        that pop() returns the greatest element according to
+ *        Compare - the first pushed among equal ones - rather than
+ *        the oldest.
  */
-
-template <typename T>
-class queueThreadSafe
+template <typename T, typename Compare = std::less<T>>
+class priorityQueueThreadSafe : public queueSignals
 {
 public:
-    enum State { OPENED, CLOSED };
+    explicit priorityQueueThreadSafe(size_t p_cap, Compare p_cmp = Compare())
+        : m_cap(p_cap), m_data(std::move(p_cmp)) {}
+    ~priorityQueueThreadSafe() { close(); }
 
-    enum class StatusCode { 
-        ERR_NO    ,  // No error
-        ERR_FULL  ,  // Capacity error - trying to push() on a queue that is full.
-        ERR_EMPTY ,  // Capacity error - trying to get() on a queue that is empty.
-        ERR_TIMOUT,  // Timeout error  - trying to get() or push() but timed out.
-        ERR_ACCESS   // Access error   - trying to get() or push() on CLOSED queue.
-    };
+    priorityQueueThreadSafe(const priorityQueueThreadSafe&) = delete;
+    priorityQueueThreadSafe& operator=(const priorityQueueThreadSafe&) = delete;
 
-    explicit queueThreadSafe(size_t p_cap = 0) : m_state(OPENED), m_size(0), m_cap(p_cap) {}
-    ~queueThreadSafe() { close(); }
+    void close()
+    {
+        std::unique_lock<std::mutex> lck(m_mtx);
+        closeLocked();
+    }
 
-    queueThreadSafe(const& queueThreadSafe) = delete;
-    queueThreadSafe& operator=(const& queueThreadSafe) = delete;
+    [[maybe_unused]] StatusCode push( const T& p_elm, uint32_t&& p_ms = 2000 ) { return pushImpl(p_elm, p_ms); }
+    [[maybe_unused]] StatusCode push( T&&      p_elm, uint32_t&& p_ms = 2000 ) { return pushImpl(std::move(p_elm), p_ms); }
 
-    static std::string getStatus( StatusCode&& p_code ) { 
-        return m_statusStr.at(p_code); 
+    /*!
+     * @brief pop
+     *        Same as queueThreadSafe::pop(): without a timeout, waits
+     *        for as long as it takes for an element to come or for
+     *        the queue to be closed.
+     */
+    std::variant<T, StatusCode> pop( std::chrono::milliseconds &&p_ms )
+    {
+        return popUntil(deadlineIn(p_ms));
     }
 
-    static std::string getStatus( const std::variant<T, StatusCode>& p_code ) {
-        return ( std::holds_alternative<StatusCode>(p_code) ) ? 
-                m_statusStr.at(std::get<StatusCode>(p_code)) : 
-                m_statusStr.at(StatusCode::ERR_NO);
+    std::variant<T, StatusCode> pop()
+    {
+        return popUntil(std::chrono::steady_clock::time_point::max());
     }
 
-    void close() 
-    { 
+private:
+    std::variant<T, StatusCode> popUntil( const std::chrono::steady_clock::time_point& p_deadline )
+    {
         std::unique_lock<std::mutex> lck(m_mtx);
-        m_state = State::CLOSED;
 
-        m_push.notify_all();
-        m_pop .notify_all();
+        const StatusCode l_status = waitForElement(lck, p_deadline, [this] { return !m_data.empty(); });
+        if ( l_status != StatusCode::ERR_NO )
+            return l_status;
+
+        T l_ret = m_data.pop();
+        m_push.notify_one();
+
+        return l_ret;
     }
 
-    /*
-     * @brief push
-     *        Will block in case of full queue untill timeout
-     *        or space appears.
-     */
-    [[maybe_unused]] StatusCode push( const T &  p_elm, 
-                                      uint32_t&& p_ms = 2000 )
+    template <typename U>
+    StatusCode pushImpl( U&& p_elm, uint32_t p_ms )
     {
         std::unique_lock<std::mutex> lck(m_mtx);
 
-        // Wait untill "There is some place" OR "timeout"
-        m_pop.wait_for(lck,
-                       std::chrono::milliseconds(p_ms),
-                       [this] { return (m_size < m_cap && m_state == State::OPENED ); });
-
-        if ( m_size == m_cap ) 
-            return StatusCode::ERR_FULL;
-
-        if ( m_state == State::CLOSED )
-            return StatusCode::ERR_ACCESS;
+        const StatusCode l_status = waitForRoom(lck,
+                                                std::chrono::steady_clock::now() + std::chrono::milliseconds(p_ms),
+                                                [this] { return m_data.size() < m_cap; });
+        if ( l_status != StatusCode::ERR_NO )
+            return l_status;
 
-        ++m_size;
-        m_data.push_back (p_elm );
+        m_data.push(std::forward<U>(p_elm));
         m_pop.notify_one();
 
         return StatusCode::ERR_NO;
     }
 
-    [[maybe_unused]] StatusCode push(T &&p_elm,
-                                     uint32_t &&p_ms = 2000 )
-    {
-        std::unique_lock<std::mutex> lck(m_mtx);
+    size_t                  m_cap;   /*!< Capacity of the queue            */
+    stableHeap<T, Compare>  m_data;  /*!< Underlying container             */
+};
 
-        // Wait untill "There is some place" OR "timeout"
-        m_pop.wait_for(lck,
-                       std::chrono::milliseconds(p_ms),
-                       [this] { return (m_size < m_cap && m_state == State::OPENED); });
+/*!
+ * @brief delayQueueThreadSafe
+ *        Every element is pushed with a due time, and only becomes
+ *        poppable once std::chrono::steady_clock reaches it - in
+ *        the order of due times, then of pushes.
+ *        pop() sleeps untill the earliest due time, rather than
+ *        being polled: it is woken up early only by close() or by
+ *        the push of an element that is due sooner.
+ *        Will return StatusCode::ERR_TIMOUT from pop() when there
+ *        are elements, but none due before timeout.
+ */
+template <typename T>
+class delayQueueThreadSafe : public queueSignals
+{
+public:
+    using Clock = std::chrono::steady_clock;
 
-        if (m_size == m_cap)
-            return StatusCode::ERR_FULL;
+    explicit delayQueueThreadSafe(size_t p_cap) : m_cap(p_cap) {}
+    ~delayQueueThreadSafe() { close(); }
 
-        if (m_state == State::CLOSED)
-            return StatusCode::ERR_ACCESS;
+    delayQueueThreadSafe(const delayQueueThreadSafe&) = delete;
+    delayQueueThreadSafe& operator=(const delayQueueThreadSafe&) = delete;
 
-        ++m_size;
-        m_data.push_back( p_elm );
-        m_pop.notify_one();
+    void close()
+    {
+        std::unique_lock<std::mutex> lck(m_mtx);
+        closeLocked();
+    }
 
-        return StatusCode::ERR_NO;
+    [[maybe_unused]] StatusCode push( const T& p_elm, Clock::time_point p_due, uint32_t&& p_ms = 2000 )
+    {
+        return pushImpl(p_elm, p_due, p_ms);
+    }
+
+    [[maybe_unused]] StatusCode push( T&& p_elm, Clock::time_point p_due, uint32_t&& p_ms = 2000 )
+    {
+        return pushImpl(std::move(p_elm), p_due, p_ms);
     }
 
     /*!
      * @brief pop
-     *        Will return a std::variant that contains
-     *        a value if possible, otherwise the corresponding StatusCode.
+     *        Without a timeout, waits for as long as it takes for an
+     *        element to be due or for the queue to be closed.
      */
-    std::variant<T, StatusCode> pop( std::chrono::milliseconds &&p_ms = std::chrono::milliseconds(1) )
+    std::variant<T, StatusCode> pop( std::chrono::milliseconds &&p_ms )
+    {
+        return popUntil(deadlineIn(p_ms));
+    }
+
+    std::variant<T, StatusCode> pop()
+    {
+        return popUntil(Clock::time_point::max());
+    }
+
+private:
+    std::variant<T, StatusCode> popUntil( const Clock::time_point& p_deadline )
     {
         std::unique_lock<std::mutex> lck(m_mtx);
+        for (;;)
+        {
+            if ( m_state == State::CLOSED )
+                return m_data.empty() ? StatusCode::ERR_EMPTY : StatusCode::ERR_ACCESS;
 
-        // Wait untill "There is one item" OR "timeout"
-        m_pop.wait_for(lck,
-                       p_ms,
-                       [this]{ return !m_data.empty() && m_state == State::OPENED; });
-        if ( m_data.empty() )
-            return StatusCode::ERR_EMPTY;
+            const auto l_now = Clock::now();
+            if ( !m_data.empty() && m_data.top().m_due <= l_now )
+                break;
 
-        if (m_state == State::CLOSED)
-            return StatusCode::ERR_ACCESS;
+            if ( l_now >= p_deadline )
+                return m_data.empty() ? StatusCode::ERR_EMPTY : StatusCode::ERR_TIMOUT;
+
+            // Sleep untill "The earliest element is due" OR "timeout"
+            m_pop.wait_until(lck, m_data.empty() ? p_deadline : std::min(p_deadline, m_data.top().m_due));
+        }
 
-        --m_size;
-        T l_ret = m_data.front();
-        m_data.pop_front();
+        T l_ret = m_data.pop().m_elm;
         m_push.notify_one();
 
+        // The next element may be due already: let another consumer have it
+        if ( !m_data.empty() )
+            m_pop.notify_one();
+
         return l_ret;
     }
 
-private:
-    State                   m_state; /*!< State of the queue               */
-    size_t                  m_size;  /*!< Current size of the queue        */
-    size_t                  m_cap;   /*!< Capacity of the queue            */
-    std::mutex              m_mtx;   /*!< Mutex for operations             */
-    std::list<T>            m_data;  /*!< Underlying container             */
-    std::condition_variable m_push;  /*!< Condition variable for producers */
-    std::condition_variable m_pop ;  /*!< Condition variable for consumers */
+    struct Delayed
+    {
+        T                 m_elm;
+        Clock::time_point m_due;
+    };
 
-    inline static const std::map<StatusCode, std::string> m_statusStr =
-        {
-            { StatusCode::ERR_NO     , "OK!\n"},
-            { StatusCode::ERR_FULL   , "Queue is full\n"},
-            { StatusCode::ERR_EMPTY  , "Queue is empty\n"},
-            { StatusCode::ERR_TIMOUT , "Timed out before end of operation\n"},
-            { StatusCode::ERR_ACCESS , "Trying to access closed queue\n"}
+    // Comes out of the heap after: the later due time
+    struct DueLater
+    {
+        bool operator()(const Delayed& p_lhs, const Delayed& p_rhs) const { return p_lhs.m_due > p_rhs.m_due; }
     };
+
+    template <typename U>
+    StatusCode pushImpl( U&& p_elm, Clock::time_point p_due, uint32_t p_ms )
+    {
+        std::unique_lock<std::mutex> lck(m_mtx);
+
+        const StatusCode l_status = waitForRoom(lck,
+                                                std::chrono::steady_clock::now() + std::chrono::milliseconds(p_ms),
+                                                [this] { return m_data.size() < m_cap; });
+        if ( l_status != StatusCode::ERR_NO )
+            return l_status;
+
+        // Consumers only need to recompute their wake-up time when
+        // the earliest due time changes.
+        const bool l_earliest = m_data.empty() || p_due < m_data.top().m_due;
+
+        m_data.push(Delayed{T(std::forward<U>(p_elm)), p_due});
+        if ( l_earliest )
+            m_pop.notify_one();
+
+        return StatusCode::ERR_NO;
+    }
+
+    size_t                          m_cap;   /*!< Capacity of the queue            */
+    stableHeap<Delayed, DueLater>   m_data;  /*!< Underlying container             */
 };
 
 int main()
@@ -214,6 +1911,277 @@ int main()
 
     myQueue.close();
 
+    // The MPMC backend has the same interface, without a lock
+    // on the way of producers and consumers.
+    const uint32_t RING_ITEMS_NB{100000};
+
+    std::atomic<uint64_t> ringSum{0};
+    std::atomic<uint32_t> ringLeft{THREADS_NB * RING_ITEMS_NB};
+    std::vector<std::thread> ringThreads;
+
+    queueThreadSafe<uint32_t, queueBackend::MPMC> ringQueue(1024);
+
+    for ( uint32_t id = 0; id < THREADS_NB; ++id )
+    {
+        ringThreads.push_back(std::thread([&] {
+            for ( uint32_t i = 1; i <= RING_ITEMS_NB; ++i )
+                ringQueue.push(i);
+        }));
+        ringThreads.push_back(std::thread([&] {
+            while ( ringLeft > 0 )
+            {
+                auto maybe = ringQueue.pop( std::chrono::milliseconds(1) );
+                if ( std::holds_alternative<uint32_t>(maybe) )
+                {
+                    ringSum += std::get<uint32_t>(maybe);
+                    --ringLeft;
+                }
+            }
+        }));
+    }
+
+    for (auto &t : ringThreads) t.join();
+    ringQueue.close();
+
+    std::cout << "MPMC sum: " << ringSum << "\n";
+
+    // With one producer and one consumer, the SPSC backend hands
+    // elements over without any read-modify-write.
+    uint64_t pipeSum{0};
+    queueThreadSafe<uint32_t, queueBackend::SPSC> pipeQueue(1024);
+
+    std::thread pipeProducer([&] {
+        for ( uint32_t i = 1; i <= RING_ITEMS_NB; ++i )
+            pipeQueue.push(i);
+    });
+    for ( uint32_t received = 0; received < RING_ITEMS_NB; )
+    {
+        auto maybe = pipeQueue.pop();
+        if ( std::holds_alternative<uint32_t>(maybe) )
+        {
+            pipeSum += std::get<uint32_t>(maybe);
+            ++received;
+        }
+    }
+    pipeProducer.join();
+    pipeQueue.close();
+
+    std::cout << "SPSC sum: " << pipeSum << "\n";
+
+    // Batches move many elements per lock and per notification.
+    std::vector<uint32_t> batchIn(RING_ITEMS_NB), batchOut;
+    for ( uint32_t i = 0; i < RING_ITEMS_NB; ++i )
+        batchIn[i] = i + 1;
+
+    queueThreadSafe<uint32_t> batchQueue(RING_ITEMS_NB);
+
+    std::thread batchProducer([&] {
+        for ( size_t i = 0; i < batchIn.size(); i += 1000 )
+            batchQueue.push_range(batchIn.begin() + i, batchIn.begin() + i + 1000);
+    });
+    // pop_up_to() sleeps untill elements come: the loop does not poll.
+    while ( batchOut.size() < RING_ITEMS_NB / 2 )
+        batchQueue.pop_up_to(256, std::back_inserter(batchOut));
+    batchProducer.join();
+    batchQueue.close();
+
+    // What is left after close() can still be drained.
+    for ( uint32_t elm : batchQueue.drain() )
+        batchOut.push_back(elm);
+
+    uint64_t batchSum{0};
+    for ( uint32_t elm : batchOut )
+        batchSum += elm;
+    std::cout << "Batch sum: " << batchSum << "\n";
+
+    // A move that throws halfway through a batch leaves the queue
+    // consistent: what was moved out is gone, the rest is still there.
+    int moveBudget = -1; // Moves left before one throws, -1 for no limit
+    struct Fragile
+    {
+        Fragile(int p_value, int* p_budget) : m_value(p_value), m_budget(p_budget) {}
+        Fragile(const Fragile&) = default;
+        Fragile(Fragile&& p_other) : m_value(p_other.m_value), m_budget(p_other.m_budget) { spend(); }
+        Fragile& operator=(Fragile&& p_other)
+        {
+            spend();
+            m_value  = p_other.m_value;
+            m_budget = p_other.m_budget;
+            return *this;
+        }
+
+        void spend()
+        {
+            if ( *m_budget == 0 )
+                throw std::runtime_error("move failed");
+            if ( *m_budget > 0 )
+                --*m_budget;
+        }
+
+        int  m_value;
+        int* m_budget;
+    };
+
+    queueThreadSafe<Fragile> fragileQueue(QUEUE_CAPACITY);
+    for ( int i = 0; i < 8; ++i )
+        fragileQueue.push(Fragile(i, &moveBudget));
+
+    std::vector<Fragile> fragileOut;
+    fragileOut.reserve(8);
+    moveBudget = 3;
+    try { fragileQueue.pop_up_to(8, std::back_inserter(fragileOut)); } catch ( const std::runtime_error& ) {}
+    moveBudget = 1; // The drained element goes down with the exception
+    try { fragileQueue.drain(); } catch ( const std::runtime_error& ) {}
+    moveBudget = -1;
+
+    // 3 elements were popped and 1 drained: 4 are left
+    fragileQueue.pop_up_to(8, std::back_inserter(fragileOut));
+    const size_t fragileLeft = fragileQueue.drain().size();
+    std::cout << "Throwing moves: " << fragileOut.size() << " popped, " << fragileLeft << " left"
+              << ( fragileOut.size() == 7 && fragileLeft == 0 ? "" : " - MISMATCH" ) << "\n";
+
+#ifdef __linux__
+    // A single thread waits on several queues at once through
+    // their eventfd, rather than polling each of them in turn.
+    queueThreadSafe<int>  tenantA(QUEUE_CAPACITY), tenantB(QUEUE_CAPACITY);
+    queueThreadSafe<int>* tenants[] = { &tenantA, &tenantB };
+
+    const int epollFd = ::epoll_create1(EPOLL_CLOEXEC);
+    for ( uint32_t i = 0; i < 2; ++i )
+    {
+        epoll_event ev{};
+        ev.events   = EPOLLIN;
+        ev.data.u32 = i;
+        ::epoll_ctl(epollFd, EPOLL_CTL_ADD, tenants[i]->eventHandle(), &ev);
+    }
+
+    std::thread tenantsProducer([&] {
+        for ( int i = 1; i <= 10; ++i )
+            tenants[i % 2]->push(i);
+    });
+
+    int tenantsSum{0};
+    for ( int received = 0; received < 10; )
+    {
+        epoll_event events[2];
+        const int   ready = ::epoll_wait(epollFd, events, 2, -1);
+        for ( int e = 0; e < ready; ++e )
+        {
+            auto& tenant = *tenants[events[e].data.u32];
+            tenant.acknowledge();
+            for ( auto maybe = tenant.pop( std::chrono::milliseconds(0) );
+                  std::holds_alternative<int>(maybe);
+                  maybe = tenant.pop( std::chrono::milliseconds(0) ) )
+            {
+                tenantsSum += std::get<int>(maybe);
+                ++received;
+            }
+        }
+    }
+    tenantsProducer.join();
+    ::close(epollFd);
+
+    std::cout << "epoll sum: " << tenantsSum << "\n";
+#endif
+
+    // A selector pops from several queues at once, here giving
+    // twice as many turns to the second queue.
+    queueThreadSafe<int> lanes[3] = { queueThreadSafe<int>(QUEUE_CAPACITY),
+                                      queueThreadSafe<int>(QUEUE_CAPACITY),
+                                      queueThreadSafe<int>(QUEUE_CAPACITY) };
+    for ( auto& lane : lanes )
+        for ( int i = 0; i < 4; ++i )
+            lane.push(i);
+
+    queueSelector<int> selector({ &lanes[0], &lanes[1], &lanes[2] }, { 1, 2, 1 });
+    std::cout << "Selected from:";
+    for ( int i = 0; i < 12; ++i )
+    {
+        auto maybe = selector.pop( std::chrono::milliseconds(1) );
+        if ( std::holds_alternative<std::pair<size_t, int>>(maybe) )
+            std::cout << " " << std::get<std::pair<size_t, int>>(maybe).first;
+    }
+    std::cout << "\n";
+
+    // Sharding: each thread pushes and pops on its own shard, and
+    // only takes from the others when it runs dry.
+    std::atomic<uint64_t> shardedSum{0};
+    std::atomic<uint32_t> shardedLeft{THREADS_NB * RING_ITEMS_NB};
+    std::vector<std::thread> shardedThreads;
+
+    shardedQueueThreadSafe<uint32_t> shardedQueue(4096, THREADS_NB);
+
+    for ( uint32_t id = 0; id < THREADS_NB; ++id )
+    {
+        shardedThreads.push_back(std::thread([&] {
+            for ( uint32_t i = 1; i <= RING_ITEMS_NB; ++i )
+                shardedQueue.push(i);
+        }));
+        shardedThreads.push_back(std::thread([&] {
+            while ( shardedLeft > 0 )
+            {
+                auto maybe = shardedQueue.pop( std::chrono::milliseconds(1) );
+                if ( std::holds_alternative<uint32_t>(maybe) )
+                {
+                    shardedSum += std::get<uint32_t>(maybe);
+                    --shardedLeft;
+                }
+            }
+        }));
+    }
+
+    for (auto &t : shardedThreads) t.join();
+    shardedQueue.close();
+
+    std::cout << "Sharded sum: " << shardedSum << "\n";
+
+    // Large messages are built in the queue and read where they
+    // lie: they are never copied.
+    struct Message
+    {
+        explicit Message(uint32_t p_id) noexcept : id(p_id) { payload.fill(char('a' + p_id % 26)); }
+
+        uint32_t              id;
+        std::array<char, 4096> payload;
+    };
+
+    queueThreadSafe<Message, queueBackend::MPMC> messageQueue(16);
+    for ( uint32_t id = 0; id < 3; ++id )
+        messageQueue.emplace(id);
+
+    std::cout << "Consumed:";
+    while ( messageQueue.consume([](const Message& msg) { std::cout << " " << msg.id << msg.payload.back(); },
+                                 std::chrono::milliseconds(1)) == queueStatus::StatusCode::ERR_NO ) {}
+    std::cout << "\n";
+
+    // Priorities: the greatest element comes out first.
+    priorityQueueThreadSafe<int> urgentQueue(QUEUE_CAPACITY);
+    for ( int prio : {3, 9, 1, 7} )
+        urgentQueue.push(prio);
+
+    std::cout << "Priorities:";
+    for ( auto maybe = urgentQueue.pop( std::chrono::milliseconds(0) );
+          std::holds_alternative<int>(maybe);
+          maybe = urgentQueue.pop( std::chrono::milliseconds(0) ) )
+        std::cout << " " << std::get<int>(maybe);
+    std::cout << "\n";
+
+    // Delays: elements come out once due, in the order of due times.
+    delayQueueThreadSafe<std::string> timerQueue(QUEUE_CAPACITY);
+    const auto start = std::chrono::steady_clock::now();
+    timerQueue.push("third" , start + std::chrono::milliseconds(30));
+    timerQueue.push("first" , start + std::chrono::milliseconds(10));
+    timerQueue.push("second", start + std::chrono::milliseconds(20));
+
+    std::cout << "Delays:";
+    for ( int i = 0; i < 3; ++i )
+    {
+        auto maybe = timerQueue.pop( std::chrono::milliseconds(100) );
+        std::cout << " " << ( std::holds_alternative<std::string>(maybe) ? std::get<std::string>(maybe)
+                                                                          : queueStatus::getStatus(maybe) );
+    }
+    std::cout << "\n";
+
     std::cout << "ok\n";
 
     return EXIT_SUCCESS;